@@ -0,0 +1,605 @@
+#include "os.h"
+
+/*
+ * Benchmarks, built in with "make run BENCH=<NAME>".
+ *
+ * bench_main() is called by os_main() before any task is created. It
+ * returns non-zero if the benchmark has created its own tasks, otherwise
+ * os_main() goes on to create the normal user tasks.
+ */
+
+/* simple LCG, good enough to shuffle sizes and orders around */
+static uint32_t _seed = 1;
+
+static inline uint32_t _rand()
+{
+	_seed = _seed * 1103515245 + 12345;
+	return (_seed >> 16) & 0x7fff;
+}
+
+#ifdef CONFIG_BENCH_PAGE
+/*
+ * Compare the page allocators (PAGE_ALLOCATOR=buddy or firstfit):
+ * - fill the heap with blocks of random size
+ * - free every other block to fragment the heap
+ * - allocate blocks of random size again, landing in the holes
+ * - free everything
+ * - with the heap fragmented by small blocks again, allocate 4M aligned
+ *   megapages until it fails, and report why it failed
+ */
+#define BENCH_PAGE_BLOCKS 512
+#define BENCH_PAGE_MEGAPAGES 8
+
+static void *_blocks[BENCH_PAGE_BLOCKS];
+static void *_megapages[BENCH_PAGE_MEGAPAGES];
+
+int bench_main(void)
+{
+	reg_t start, alloc_cycles, frag_cycles, free_cycles;
+	int failed = 0;
+
+	start = r_mcycle();
+	for (int i = 0; i < BENCH_PAGE_BLOCKS; i++) {
+		_blocks[i] = page_alloc(1 + _rand() % 8);
+		if (_blocks[i] == NULL) {
+			failed++;
+		}
+	}
+	alloc_cycles = r_mcycle() - start;
+
+	for (int i = 1; i < BENCH_PAGE_BLOCKS; i += 2) {
+		page_free(_blocks[i]);
+		_blocks[i] = NULL;
+	}
+
+	start = r_mcycle();
+	for (int i = 1; i < BENCH_PAGE_BLOCKS; i += 2) {
+		_blocks[i] = page_alloc(1 + _rand() % 16);
+		if (_blocks[i] == NULL) {
+			failed++;
+		}
+	}
+	frag_cycles = r_mcycle() - start;
+
+	start = r_mcycle();
+	for (int i = 0; i < BENCH_PAGE_BLOCKS; i++) {
+		page_free(_blocks[i]);
+		_blocks[i] = NULL;
+	}
+	free_cycles = r_mcycle() - start;
+
+	printf("BENCH PAGE: %d blocks, %d failed\n", BENCH_PAGE_BLOCKS, failed);
+	printf("  alloc:            %d cycles/op\n", alloc_cycles / BENCH_PAGE_BLOCKS);
+	printf("  alloc fragmented: %d cycles/op\n", frag_cycles / (BENCH_PAGE_BLOCKS / 2));
+	printf("  free:             %d cycles/op\n", free_cycles / BENCH_PAGE_BLOCKS);
+
+	for (int i = 0; i < BENCH_PAGE_BLOCKS; i++) {
+		_blocks[i] = page_alloc(1 + _rand() % 8);
+	}
+	for (int i = 1; i < BENCH_PAGE_BLOCKS; i += 2) {
+		page_free(_blocks[i]);
+		_blocks[i] = NULL;
+	}
+
+	int n = 0;
+	start = r_mcycle();
+	while (n < BENCH_PAGE_MEGAPAGES) {
+		_megapages[n] = page_alloc_aligned(1 << MEGAPAGE_ORDER, MEGAPAGE_ORDER);
+		if (_megapages[n] == NULL) {
+			break;
+		}
+		n++;
+	}
+	alloc_cycles = r_mcycle() - start;
+
+	printf("  megapages:        %d allocated, %d cycles\n", n, alloc_cycles);
+	if (n < BENCH_PAGE_MEGAPAGES) {
+		printf("  megapage failure: %s\n", page_strerror(page_errno()));
+	}
+	page_stat_dump();
+
+	for (int i = 0; i < n; i++) {
+		page_free(_megapages[i]);
+	}
+	for (int i = 0; i < BENCH_PAGE_BLOCKS; i++) {
+		page_free(_blocks[i]);
+	}
+
+	return 0;
+}
+#endif /* CONFIG_BENCH_PAGE */
+
+#ifdef CONFIG_BENCH_SLAB
+/*
+ * Cost of small objects: kmalloc() of random sizes up to 256 bytes against
+ * a whole page_alloc(1) for each object.
+ */
+#define BENCH_SLAB_OBJS 256
+
+static void *_objs[BENCH_SLAB_OBJS];
+
+int bench_main(void)
+{
+	reg_t start, kmalloc_cycles, page_cycles;
+
+	start = r_mcycle();
+	for (int round = 0; round < 4; round++) {
+		for (int i = 0; i < BENCH_SLAB_OBJS; i++) {
+			_objs[i] = kmalloc(1 + _rand() % 256);
+		}
+		for (int i = 0; i < BENCH_SLAB_OBJS; i++) {
+			kfree(_objs[i]);
+		}
+	}
+	kmalloc_cycles = r_mcycle() - start;
+
+	start = r_mcycle();
+	for (int round = 0; round < 4; round++) {
+		for (int i = 0; i < BENCH_SLAB_OBJS; i++) {
+			_objs[i] = page_alloc(1);
+		}
+		for (int i = 0; i < BENCH_SLAB_OBJS; i++) {
+			page_free(_objs[i]);
+		}
+	}
+	page_cycles = r_mcycle() - start;
+
+	printf("BENCH SLAB: %d objects x 4 rounds\n", BENCH_SLAB_OBJS);
+	printf("  kmalloc/kfree:        %d cycles/pair\n", kmalloc_cycles / (BENCH_SLAB_OBJS * 4));
+	printf("  page_alloc/page_free: %d cycles/pair\n", page_cycles / (BENCH_SLAB_OBJS * 4));
+	slab_dump();
+
+	return 0;
+}
+#endif /* CONFIG_BENCH_SLAB */
+
+#ifdef CONFIG_BENCH_SLEEP
+#include "user_api.h"
+
+/*
+ * CPU given back by sleeping tasks: a worker counts as fast as it can
+ * while BENCH_SLEEP_WAITERS tasks of the same priority wait for the next
+ * tick, first with task_delay() busy loops and then with task_sleep().
+ * A reporter sleeps for a tick again and again, and prints how far the
+ * worker got meanwhile.
+ */
+#define BENCH_SLEEP_WAITERS 3
+#define BENCH_SLEEP_TICKS 5
+
+#define MODE_DELAY 0
+#define MODE_SLEEP 1
+#define MODE_DONE 2
+
+static volatile int _mode = MODE_DELAY;
+static volatile uint32_t _work = 0;
+
+static void _worker(void *arg)
+{
+	while (1) {
+		_work++;
+	}
+}
+
+static void _waiter(void *arg)
+{
+	while (_mode == MODE_DELAY) {
+		task_delay(100);
+	}
+	while (_mode == MODE_SLEEP) {
+		task_sleep(1);
+	}
+}
+
+static void _reporter(void *arg)
+{
+	static const char *names[] = { "task_delay", "task_sleep" };
+	uint32_t total[2] = { 0, 0 };
+
+	for (int mode = MODE_DELAY; mode <= MODE_SLEEP; mode++) {
+		_mode = mode;
+		task_sleep(1);
+		for (int i = 0; i < BENCH_SLEEP_TICKS; i++) {
+			uint32_t start = _work;
+			task_sleep(1);
+			printf("BENCH SLEEP: %s, worker did %d loops\n",
+			       names[mode], _work - start);
+			total[mode] += _work - start;
+		}
+	}
+	_mode = MODE_DONE;
+
+	printf("BENCH SLEEP: worker loops per period, %d waiters\n", BENCH_SLEEP_WAITERS);
+	printf("  waiting with task_delay(): %d\n", total[MODE_DELAY] / BENCH_SLEEP_TICKS);
+	printf("  waiting with task_sleep(): %d\n", total[MODE_SLEEP] / BENCH_SLEEP_TICKS);
+}
+
+int bench_main(void)
+{
+	struct task_attr attr = { .priority = 1, .detached = 1 };
+
+	for (int i = 0; i < BENCH_SLEEP_WAITERS; i++) {
+		task_create(_waiter, &attr);
+	}
+	task_create(_worker, &attr);
+
+	attr.priority = 0;
+	task_create(_reporter, &attr);
+
+	return 1;
+}
+#endif /* CONFIG_BENCH_SLEEP */
+
+#ifdef CONFIG_BENCH_STEAL
+#include "user_api.h"
+
+/*
+ * Imbalanced load across harts, run with NCPU > 1 and compare
+ * SCHED_STEAL=y with SCHED_STEAL=n:
+ * BENCH_STEAL_TASKS workers are created at boot and handed out to the
+ * harts in turn, but every NCPU-th of them, all on the same hart, does
+ * BENCH_STEAL_HEAVY times the work of the others. A reporter joins them
+ * all and prints how long it took, and how many tasks were migrated.
+ */
+#define BENCH_STEAL_TASKS (4 * NCPU)
+#define BENCH_STEAL_HEAVY 8
+#define BENCH_STEAL_UNIT 20
+
+static int _ids[BENCH_STEAL_TASKS];
+static uint64_t _start;
+
+static void _busy(void *arg)
+{
+	task_delay((int)arg);
+}
+
+static void _reporter(void *arg)
+{
+	for (int i = 0; i < BENCH_STEAL_TASKS; i++) {
+		task_join(_ids[i], NULL);
+	}
+	uint32_t ms = (uint32_t)(get_mtime() - _start) / (CLINT_TIMEBASE_FREQ / 1000);
+
+	printf("BENCH STEAL: %d tasks on %d harts, done in %d ms\n",
+	       BENCH_STEAL_TASKS, NCPU, ms);
+	sched_stat_dump();
+}
+
+int bench_main(void)
+{
+	struct task_attr attr = { .priority = 1 };
+
+	_start = get_mtime();
+	for (int i = 0; i < BENCH_STEAL_TASKS; i++) {
+		int units = (i % NCPU == 0) ? BENCH_STEAL_HEAVY : 1;
+		attr.arg = (void *)(units * BENCH_STEAL_UNIT);
+		_ids[i] = task_create(_busy, &attr);
+	}
+
+	attr.arg = NULL;
+	attr.priority = 0;
+	attr.detached = 1;
+	task_create(_reporter, &attr);
+
+	return 1;
+}
+#endif /* CONFIG_BENCH_STEAL */
+
+#ifdef CONFIG_BENCH_FAIR
+#include "user_api.h"
+
+/*
+ * CPU shares of SCHED_FAIR tasks: workers of different nice levels count
+ * as fast as they can, and one more task counts a little and yields, as
+ * an interactive task would. A SCHED_PRIO reporter sleeps for a few
+ * ticks and prints how far each got. Each nice level gets ~1.25 times
+ * the CPU of the one above it, and the yielding task is not left behind.
+ * Run with NCPU=1 to see the shares of a single hart.
+ */
+#define BENCH_FAIR_TICKS 5
+
+static const int _nices[] = { -5, 0, 5 };
+#define BENCH_FAIR_WORKERS (sizeof(_nices) / sizeof(_nices[0]))
+
+static volatile uint32_t _counts[BENCH_FAIR_WORKERS + 1];
+
+static void _counter(void *arg)
+{
+	volatile uint32_t *count = arg;
+
+	while (1) {
+		(*count)++;
+	}
+}
+
+static void _yielder(void *arg)
+{
+	volatile uint32_t *count = arg;
+
+	while (1) {
+		for (int i = 0; i < 1000; i++) {
+			(*count)++;
+		}
+		task_yield();
+	}
+}
+
+static void _reporter(void *arg)
+{
+	task_sleep(BENCH_FAIR_TICKS);
+
+	printf("BENCH FAIR: loops in %d ticks\n", BENCH_FAIR_TICKS);
+	for (int i = 0; i < BENCH_FAIR_WORKERS; i++) {
+		printf("  nice %d: %d\n", _nices[i], _counts[i]);
+	}
+	printf("  nice 0, yielding: %d\n", _counts[BENCH_FAIR_WORKERS]);
+}
+
+int bench_main(void)
+{
+	struct task_attr attr = { .detached = 1, .policy = SCHED_FAIR };
+
+	for (int i = 0; i < BENCH_FAIR_WORKERS; i++) {
+		attr.arg = (void *)&_counts[i];
+		attr.nice = _nices[i];
+		task_create(_counter, &attr);
+	}
+
+	attr.arg = (void *)&_counts[BENCH_FAIR_WORKERS];
+	attr.nice = 0;
+	task_create(_yielder, &attr);
+
+	attr.arg = NULL;
+	attr.policy = SCHED_PRIO;
+	task_create(_reporter, &attr);
+
+	return 1;
+}
+#endif /* CONFIG_BENCH_FAIR */
+
+#ifdef CONFIG_BENCH_EDF
+#include "user_api.h"
+
+/*
+ * Periodic tasks under SCHED_EDF, run with TICKLESS=y:
+ * - two control loops which stay within their budgets
+ * - one task whose jobs need twice its budget, so it is throttled
+ * - a CPU hog of the highest SCHED_PRIO priority, which must not delay
+ *   the control loops
+ * Then 90% tasks are created till one does not fit any more, and it must
+ * not be admitted. After a few ticks the jobs done and missed of each task are
+ * printed.
+ */
+#define BENCH_EDF_TICKS 3
+
+struct edf_loop {
+	const char *name;
+	uint32_t period;	/* us */
+	uint32_t budget;	/* us */
+	uint32_t work;		/* us a job runs */
+	volatile uint32_t jobs;
+	volatile int misses;
+};
+
+static struct edf_loop _loops[] = {
+	{ "10ms/2ms, 1ms jobs", 10000, 2000, 1000 },
+	{ "20ms/5ms, 3ms jobs", 20000, 5000, 3000 },
+	{ "50ms/2ms, 4ms jobs", 50000, 2000, 4000 },
+};
+#define BENCH_EDF_LOOPS (sizeof(_loops) / sizeof(_loops[0]))
+
+static void _loop(void *arg)
+{
+	struct edf_loop *l = arg;
+
+	while (1) {
+		uint64_t start = get_mtime();
+		while (get_mtime() - start < US_TO_MTIME(l->work)) {
+		}
+		l->jobs++;
+		l->misses = task_wait_period();
+	}
+}
+
+static void _hog(void *arg)
+{
+	while (1) {
+	}
+}
+
+static void _reporter(void *arg)
+{
+	task_sleep(BENCH_EDF_TICKS);
+
+	printf("BENCH EDF: %d ticks\n", BENCH_EDF_TICKS);
+	for (int i = 0; i < BENCH_EDF_LOOPS; i++) {
+		printf("  %s: %d jobs, %d missed\n",
+		       _loops[i].name, _loops[i].jobs, _loops[i].misses);
+	}
+	sched_stat_dump();
+}
+
+int bench_main(void)
+{
+	struct task_attr attr = { .detached = 1, .policy = SCHED_EDF };
+
+	for (int i = 0; i < BENCH_EDF_LOOPS; i++) {
+		attr.arg = &_loops[i];
+		attr.period = _loops[i].period;
+		attr.budget = _loops[i].budget;
+		if (task_create(_loop, &attr) < 0) {
+			printf("BENCH EDF: %s not admitted\n", _loops[i].name);
+		}
+	}
+
+	/*
+	 * A 10ms/9ms task per hart, which never waits for its period: the
+	 * harts without a loop take one each and throttle it, the hart
+	 * with the loops can not take one.
+	 */
+	attr.arg = NULL;
+	attr.period = 10000;
+	attr.budget = 9000;
+	for (int i = 0; i < NCPU; i++) {
+		if (task_create(_hog, &attr) < 0) {
+			printf("BENCH EDF: 10ms/9ms task %d not admitted\n", i);
+		}
+	}
+
+	attr.policy = SCHED_PRIO;
+	attr.priority = 0;
+	for (int i = 0; i < NCPU; i++) {
+		task_create(_hog, &attr);
+	}
+	task_create(_reporter, &attr);
+
+	return 1;
+}
+#endif /* CONFIG_BENCH_EDF */
+
+#ifdef CONFIG_BENCH_YIELD
+#include "user_api.h"
+
+/*
+ * Cost of a yield: two tasks of the same priority yield to each other
+ * BENCH_YIELD_ROUNDS times with sched_yield(), which switches right in the
+ * syscall. task_yield() takes the same syscall, U-mode can not raise a
+ * software interrupt. U-mode can not read mcycle either, so the time per
+ * yield is taken from mtime, and the cycles spent in the kernel from
+ * task_stat().
+ * Run with NCPU=1, so that both tasks share a hart, and compare
+ * YIELD_CALLEE_SAVED=y with YIELD_CALLEE_SAVED=n to see what the
+ * callee-saved frame of sched_yield() saves over a full trap frame.
+ */
+#define BENCH_YIELD_ROUNDS 1000
+
+static void _pingpong(void *arg)
+{
+	int report = (int)arg;
+	struct task_stat st;
+
+	task_stat(0, &st);
+	uint64_t trap_cycles = st.trap_cycles;
+	uint64_t start = get_mtime();
+
+	for (int i = 0; i < BENCH_YIELD_ROUNDS; i++) {
+		sched_yield();
+	}
+
+	/* both tasks yield once a round */
+	uint32_t elapsed = (uint32_t)(get_mtime() - start) / (2 * BENCH_YIELD_ROUNDS);
+	task_stat(0, &st);
+	trap_cycles = st.trap_cycles - trap_cycles;
+	if (report) {
+		printf("BENCH YIELD: sched_yield\n");
+		printf("  %d ns/yield, %d kernel cycles/yield\n",
+		       elapsed * 1000 / US_TO_MTIME(1),
+		       (uint32_t)trap_cycles / BENCH_YIELD_ROUNDS);
+		task_dump();
+	}
+}
+
+int bench_main(void)
+{
+	struct task_attr attr = { .arg = (void *)1, .priority = 1, .detached = 1 };
+
+	task_create(_pingpong, &attr);
+	attr.arg = (void *)0;
+	task_create(_pingpong, &attr);
+
+	return 1;
+}
+#endif /* CONFIG_BENCH_YIELD */
+
+#ifdef CONFIG_BENCH_FP
+#include "user_api.h"
+
+/*
+ * FP registers across preemption and migration, run with NCPU > 1 and
+ * SCHED_STEAL=y: BENCH_FP_TASKS tasks of the same priority, more than the
+ * harts, each fill all 32 F registers with values of their own, spin for
+ * about a time slice, so they are likely switched out and may be stolen
+ * by another hart meanwhile, and check the registers are still theirs.
+ * Each exits with the number of registers it has found corrupted, and a
+ * reporter joins them and prints the total and the FP saves and loads.
+ */
+#define BENCH_FP_TASKS (3 * NCPU + 1)
+#define BENCH_FP_ROUNDS 3
+#define BENCH_FP_SPINS 100000000
+
+static int _ids[BENCH_FP_TASKS];
+
+/* f[i] = seed + i, spin, then count the f[i] which are not seed + i any more */
+static int _fp_round(int seed)
+{
+	int bad;
+
+	asm volatile(
+		".irp i, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31\n"
+		"addi	t0, %[seed], \\i\n"
+		"fcvt.d.w	f\\i, t0\n"
+		".endr\n"
+		"li	t1, %[spins]\n"
+		"1:\n"
+		"addi	t1, t1, -1\n"
+		"bnez	t1, 1b\n"
+		"li	%[bad], 0\n"
+		".irp i, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31\n"
+		"fcvt.w.d	t0, f\\i\n"
+		"addi	t2, %[seed], \\i\n"
+		"beq	t0, t2, 2f\n"
+		"addi	%[bad], %[bad], 1\n"
+		"2:\n"
+		".endr\n"
+		: [bad] "=&r" (bad)
+		: [seed] "r" (seed), [spins] "i" (BENCH_FP_SPINS)
+		: "t0", "t1", "t2",
+		  "f0", "f1", "f2", "f3", "f4", "f5", "f6", "f7",
+		  "f8", "f9", "f10", "f11", "f12", "f13", "f14", "f15",
+		  "f16", "f17", "f18", "f19", "f20", "f21", "f22", "f23",
+		  "f24", "f25", "f26", "f27", "f28", "f29", "f30", "f31");
+	return bad;
+}
+
+static void _fp_worker(void *arg)
+{
+	int bad = 0;
+
+	for (int i = 0; i < BENCH_FP_ROUNDS; i++) {
+		bad += _fp_round((int)arg * 100 + i);
+	}
+	task_exit(bad);
+}
+
+static void _reporter(void *arg)
+{
+	int total = 0;
+
+	for (int i = 0; i < BENCH_FP_TASKS; i++) {
+		int bad = 0;
+		task_join(_ids[i], &bad);
+		total += bad;
+	}
+
+	printf("BENCH FP: %d tasks x %d rounds on %d harts, %d registers corrupted\n",
+	       BENCH_FP_TASKS, BENCH_FP_ROUNDS, NCPU, total);
+	sched_stat_dump();
+	task_dump();
+}
+
+int bench_main(void)
+{
+	struct task_attr attr = { .priority = 1 };
+
+	for (int i = 0; i < BENCH_FP_TASKS; i++) {
+		attr.arg = (void *)(i + 1);
+		_ids[i] = task_create(_fp_worker, &attr);
+	}
+
+	attr.arg = NULL;
+	attr.priority = 0;
+	attr.detached = 1;
+	task_create(_reporter, &attr);
+
+	return 1;
+}
+#endif /* CONFIG_BENCH_FP */
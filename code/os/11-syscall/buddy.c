@@ -0,0 +1,310 @@
+#include "os.h"
+
+/*
+ * Binary buddy allocator, used by page.c as the backend of
+ * page_alloc()/page_free() when CONFIG_PAGE_BUDDY is defined.
+ *
+ * Free memory is kept in blocks of 2^order pages, order = 0..BUDDY_MAX_ORDER,
+ * and each order has its own free list. Allocation takes the smallest block
+ * which is big enough and splits it down, freeing coalesces a block with its
+ * buddy as long as the buddy is free too. Both take O(BUDDY_MAX_ORDER).
+ *
+ * Block addresses are computed relative to _base, which is _start rounded
+ * down to the size of the largest block, so a block of order k is always
+ * aligned to (PAGE_SIZE << k) in physical memory.
+ *
+ * Pages are handed to the allocator with buddy_grow(), which initializes
+ * their meta data and frees them into the lists. Only [_start, _init_end)
+ * is managed so far, the rest is added on demand or in the background.
+ */
+
+#define BUDDY_MAX_ORDER 14	/* 2^14 pages, i.e. 64M */
+
+/*
+ * Per-page meta data, 5 bits for each page in [_start, _end), packed in
+ * two arrays:
+ * - _order_map: 4 bits each, two pages to a byte, order + 1 of the block
+ *   for the first page of a block, 0 for any other page
+ * - _free_map: 1 bit each, 32 pages to a word, set if the page is the
+ *   first page of a free block (on a free list)
+ * The first page of an allocated block has its order and no free bit.
+ */
+#define BUDDY_ORDER_BITS 4
+
+/*
+ * Free list node, stored in the first bytes of the free block itself,
+ * so the free lists cost no extra memory.
+ */
+struct free_block {
+	struct free_block *next;
+	struct free_block *prev;
+};
+
+static struct free_block _free_area[BUDDY_MAX_ORDER + 1];
+static uint32_t _nr_free[BUDDY_MAX_ORDER + 1];
+
+static uint32_t *_free_map = NULL;
+static uint8_t *_order_map = NULL;
+static ptr_t _base = 0;
+static ptr_t _start = 0;
+static ptr_t _end = 0;
+static ptr_t _init_end = 0;
+
+/* pages added at a time when an allocation runs out of initialized pages */
+#define BUDDY_GROW_PAGES 1024
+
+static inline uint32_t _index(ptr_t addr)
+{
+	return (addr - _start) >> PAGE_ORDER;
+}
+
+/* order of the block starting at page i, or -1 if no block starts there */
+static inline int _order_at(uint32_t i)
+{
+	return ((_order_map[i / 2] >> (i % 2 * BUDDY_ORDER_BITS)) & 0xf) - 1;
+}
+
+static inline int _free_at(uint32_t i)
+{
+	return (_free_map[i / 32] >> (i % 32)) & 1;
+}
+
+/* set the meta data of page i, order -1 for no block */
+static inline void _set_meta(uint32_t i, int order, int free)
+{
+	uint8_t *b = &_order_map[i / 2];
+	int shift = i % 2 * BUDDY_ORDER_BITS;
+
+	*b = (*b & ~(0xf << shift)) | ((order + 1) << shift);
+	if (free) {
+		_free_map[i / 32] |= 1u << (i % 32);
+	} else {
+		_free_map[i / 32] &= ~(1u << (i % 32));
+	}
+}
+
+static inline ptr_t _block_size(int order)
+{
+	return (ptr_t)PAGE_SIZE << order;
+}
+
+static inline void _list_add(struct free_block *head, struct free_block *b)
+{
+	b->next = head->next;
+	b->prev = head;
+	head->next->prev = b;
+	head->next = b;
+}
+
+static inline void _list_del(struct free_block *b)
+{
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+}
+
+static inline void _push(ptr_t addr, int order)
+{
+	_set_meta(_index(addr), order, 1);
+	_list_add(&_free_area[order], (struct free_block *)addr);
+	_nr_free[order]++;
+}
+
+static inline void _remove(ptr_t addr, int order)
+{
+	_set_meta(_index(addr), -1, 0);
+	_list_del((struct free_block *)addr);
+	_nr_free[order]--;
+}
+
+/*
+ * Give the block at addr back to the free lists, merging it with its
+ * buddy again and again until the buddy is not free or the largest
+ * order is reached.
+ */
+static void _free_block(ptr_t addr, int order)
+{
+	/* it may end up inside a merged block, not as its first page */
+	_set_meta(_index(addr), -1, 0);
+
+	while (order < BUDDY_MAX_ORDER) {
+		ptr_t buddy = _base + ((addr - _base) ^ _block_size(order));
+		if (buddy < _start || buddy + _block_size(order) > _init_end) {
+			break;
+		}
+		uint32_t i = _index(buddy);
+		if (!_free_at(i) || _order_at(i) != order) {
+			break;
+		}
+		_remove(buddy, order);
+		if (buddy < addr) {
+			addr = buddy;
+		}
+		order++;
+	}
+	_push(addr, order);
+}
+
+/*
+ * DESCRIPTION
+ * 	Set up the buddy allocator for the pages in
+ * 	[start, start + npages * PAGE_SIZE), no page is free until it is
+ * 	added with buddy_grow().
+ * 	- meta: memory to hold the per-page meta data, 4-byte aligned,
+ * 	  (npages + 31) / 32 words for _free_map followed by
+ * 	  (npages + 1) / 2 bytes for _order_map.
+ * 	- start: address of the first page, must be page aligned.
+ * 	- npages: number of pages.
+ */
+void buddy_init(void *meta, ptr_t start, uint32_t npages)
+{
+	_free_map = (uint32_t *)meta;
+	_order_map = (uint8_t *)(_free_map + (npages + 31) / 32);
+	_start = start;
+	_end = start + npages * PAGE_SIZE;
+	_init_end = start;
+	_base = start & ~(_block_size(BUDDY_MAX_ORDER) - 1);
+
+	for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+		_free_area[i].next = &_free_area[i];
+		_free_area[i].prev = &_free_area[i];
+		_nr_free[i] = 0;
+	}
+}
+
+/*
+ * DESCRIPTION
+ * 	Initialize the meta data of up to npages more pages and free them.
+ * RETURN VALUE
+ * 	number of pages still left uninitialized.
+ */
+uint32_t buddy_grow(uint32_t npages)
+{
+	ptr_t addr = _init_end;
+	ptr_t end = _init_end + npages * PAGE_SIZE;
+	if (end > _end || end < addr) {
+		end = _end;
+	}
+
+	for (uint32_t i = _index(addr); i < _index(end); i++) {
+		_set_meta(i, -1, 0);
+	}
+	_init_end = end;
+
+	/*
+	 * Carve the range into the largest naturally aligned blocks, they
+	 * are merged with free neighbours added earlier.
+	 */
+	while (addr < end) {
+		int order = BUDDY_MAX_ORDER;
+		while (((addr - _base) & (_block_size(order) - 1)) ||
+		       addr + _block_size(order) > end) {
+			order--;
+		}
+		_free_block(addr, order);
+		addr += _block_size(order);
+	}
+
+	return (_end - _init_end) / PAGE_SIZE;
+}
+
+/*
+ * DESCRIPTION
+ * 	Allocate a block of 2^order contiguous pages.
+ * RETURN VALUE
+ * 	address of the first page, or 0 if no block is big enough.
+ */
+ptr_t buddy_alloc(int order)
+{
+	if (order < 0 || order > BUDDY_MAX_ORDER) {
+		return 0;
+	}
+
+	int o;
+	for (;;) {
+		o = order;
+		while (o <= BUDDY_MAX_ORDER && _nr_free[o] == 0) {
+			o++;
+		}
+		if (o <= BUDDY_MAX_ORDER) {
+			break;
+		}
+		/* first touch of pages not initialized yet */
+		if (_init_end == _end) {
+			return 0;
+		}
+		buddy_grow(BUDDY_GROW_PAGES);
+	}
+
+	ptr_t addr = (ptr_t)_free_area[o].next;
+	_remove(addr, o);
+
+	/* split, and put the upper halves back to the free lists */
+	while (o > order) {
+		o--;
+		_push(addr + _block_size(o), o);
+	}
+
+	_set_meta(_index(addr), order, 0);
+	return addr;
+}
+
+/*
+ * DESCRIPTION
+ * 	Free a block returned by buddy_alloc().
+ * RETURN VALUE
+ * 	number of pages freed, or 0 if addr is not an allocated block.
+ */
+uint32_t buddy_free(ptr_t addr)
+{
+	if (addr < _start || addr >= _init_end || (addr & (PAGE_SIZE - 1))) {
+		return 0;
+	}
+
+	uint32_t i = _index(addr);
+	int order = _order_at(i);
+	if (order < 0 || _free_at(i)) {
+		return 0;
+	}
+
+	_free_block(addr, order);
+	return 1 << order;
+}
+
+/*
+ * DESCRIPTION
+ * 	Get the order of the allocated block at addr.
+ * RETURN VALUE
+ * 	the order, or -1 if addr is not an allocated block.
+ */
+int buddy_order(ptr_t addr)
+{
+	if (addr < _start || addr >= _init_end || (addr & (PAGE_SIZE - 1))) {
+		return -1;
+	}
+
+	uint32_t i = _index(addr);
+	if (_free_at(i)) {
+		return -1;
+	}
+	return _order_at(i);
+}
+
+/* the largest order with a free block, or -1 if there is none */
+int buddy_max_free_order()
+{
+	for (int i = BUDDY_MAX_ORDER; i >= 0; i--) {
+		if (_nr_free[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void buddy_dump()
+{
+	printf("buddy free blocks:");
+	for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+		printf(" %d", _nr_free[i]);
+	}
+	printf("\n");
+}
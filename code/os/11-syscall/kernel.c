@@ -6,19 +6,89 @@
  */
 extern void uart_init(void);
 extern void page_init(void);
+extern void slab_init(void);
+extern void vm_init(void);
 extern void sched_init(void);
+extern void sched_init_hart(void);
+extern int sched_nr_online(void);
 extern void schedule(void);
 extern void os_main(void);
 extern void trap_init(void);
 extern void plic_init(void);
 extern void timer_init(void);
+extern void timer_init_hart(void);
+
+/*
+ * Boot phase timestamps in mcycle, printed by boot_report() before the
+ * first task runs. Marks made after that are printed right away.
+ */
+#define MAX_BOOT_MARKS 16
+
+struct boot_mark {
+	const char *name;
+	reg_t cycle;
+};
+
+static struct boot_mark _boot_marks[MAX_BOOT_MARKS];
+static int _nr_boot_marks = 0;
+static int _boot_reported = 0;
+
+/* mcycle at _start and when BSS has been cleared, saved by start.S */
+extern reg_t boot_cycles[2];
+/* the other harts wait in start.S till it is set */
+extern volatile reg_t smp_released;
+
+static void _boot_mark_at(const char *name, reg_t cycle)
+{
+	if (_nr_boot_marks < MAX_BOOT_MARKS) {
+		_boot_marks[_nr_boot_marks].name = name;
+		_boot_marks[_nr_boot_marks].cycle = cycle;
+		_nr_boot_marks++;
+	}
+}
+
+void boot_mark(const char *name)
+{
+	reg_t now = r_mcycle();
+
+	if (_boot_reported) {
+		printf("boot: %s done at cycle %d\n", name, now);
+		return;
+	}
+	_boot_mark_at(name, now);
+}
+
+static void boot_report(void)
+{
+	reg_t prev = 0;
+
+	printf("boot phases (mcycle):\n");
+	for (int i = 0; i < _nr_boot_marks; i++) {
+		struct boot_mark *m = &_boot_marks[i];
+		printf("  %s\t+%d\t(at %d)\n", m->name, m->cycle - prev, m->cycle);
+		prev = m->cycle;
+	}
+	_boot_reported = 1;
+}
 
 void start_kernel(void)
 {
+	_boot_mark_at("_start", boot_cycles[0]);
+	_boot_mark_at("bss clear", boot_cycles[1]);
+	boot_mark("start_kernel");
+
 	uart_init();
 	uart_puts("Hello, RVOS!\n");
+	boot_mark("uart_init");
 
 	page_init();
+	boot_mark("page_init");
+
+	slab_init();
+	boot_mark("slab_init");
+
+	vm_init();
+	boot_mark("vm_init");
 
 	trap_init();
 
@@ -27,8 +97,46 @@ void start_kernel(void)
 	timer_init();
 
 	sched_init();
+	boot_mark("trap/plic/timer/sched_init");
+
+	/*
+	 * Let the other harts in and wait till they are online, so that
+	 * the tasks created by os_main() are spread over all of them.
+	 * They sleep in wfi, kick them first, so that the kick is there
+	 * when they see smp_released and acknowledge it.
+	 */
+	for (int i = 1; i < NCPU; i++) {
+		*(uint32_t *)CLINT_MSIP(i) = 1;
+	}
+	__sync_synchronize();
+	smp_released = 1;
+	while (sched_nr_online() < NCPU) {}
+	boot_mark("smp");
 
 	os_main();
+	boot_mark("os_main");
+
+	boot_report();
+
+	schedule();
+
+	uart_puts("Would not go here!\n");
+	while (1) {}; // stop here!
+}
+
+/*
+ * Entry of the other harts, see start.S. Everything shared is set up by
+ * hart 0 already, so only the per-hart parts are done here.
+ */
+void start_kernel_hart(void)
+{
+	trap_init();
+
+	plic_init();
+
+	timer_init_hart();
+
+	sched_init_hart();
 
 	schedule();
 
@@ -11,3 +11,37 @@ int spin_unlock()
 	w_mstatus(r_mstatus() | MSTATUS_MIE);
 	return 0;
 }
+
+/*
+ * Spinlocks for data shared between harts.
+ * They don't touch mstatus.MIE, the kernel runs with interrupts off.
+ */
+void lock_init(struct spinlock *lk)
+{
+	lk->locked = 0;
+}
+
+void lock_acquire(struct spinlock *lk)
+{
+	/* amoswap.w.aq, spin until we are the one who changed 0 to 1 */
+	while (__sync_lock_test_and_set(&lk->locked, 1) != 0) {
+	}
+	__sync_synchronize();
+}
+
+/* take the lock only if it is free, return 1 if we got it */
+int lock_tryacquire(struct spinlock *lk)
+{
+	if (__sync_lock_test_and_set(&lk->locked, 1) != 0) {
+		return 0;
+	}
+	__sync_synchronize();
+	return 1;
+}
+
+void lock_release(struct spinlock *lk)
+{
+	__sync_synchronize();
+	/* amoswap.w.rl, store 0 */
+	__sync_lock_release(&lk->locked);
+}
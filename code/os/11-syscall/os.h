@@ -8,6 +8,31 @@
 #include <stddef.h>
 #include <stdarg.h>
 
+/* bit operations */
+/* index of the least significant 1 bit, x must not be 0 */
+static inline int ctz32(uint32_t x)
+{
+	int n = 0;
+	if (!(x & 0xffff)) { n += 16; x >>= 16; }
+	if (!(x & 0xff))   { n += 8;  x >>= 8; }
+	if (!(x & 0xf))    { n += 4;  x >>= 4; }
+	if (!(x & 0x3))    { n += 2;  x >>= 2; }
+	if (!(x & 0x1))    { n += 1; }
+	return n;
+}
+
+/* number of leading 0 bits, x must not be 0 */
+static inline int clz32(uint32_t x)
+{
+	int n = 0;
+	if (!(x & 0xffff0000)) { n += 16; x <<= 16; }
+	if (!(x & 0xff000000)) { n += 8;  x <<= 8; }
+	if (!(x & 0xf0000000)) { n += 4;  x <<= 4; }
+	if (!(x & 0xc0000000)) { n += 2;  x <<= 2; }
+	if (!(x & 0x80000000)) { n += 1; }
+	return n;
+}
+
 /* uart */
 extern int uart_putc(char ch);
 extern void uart_puts(char *s);
@@ -17,9 +42,50 @@ extern int uart_getc(void);
 extern int  printf(const char* s, ...);
 extern void panic(char *s);
 
+/* boot phase timestamps */
+extern void boot_mark(const char *name);
+
 /* memory management */
+#define PAGE_SIZE 4096
+#define PAGE_ORDER 12
+#define MEGAPAGE_ORDER 10	/* 4M = 2^10 pages, an Sv32 megapage */
+
+/* reasons of page allocation failures, see page_errno() */
+#define PAGE_ERR_NONE	0
+#define PAGE_ERR_INVAL	1	/* bad size or alignment */
+#define PAGE_ERR_NOMEM	2	/* not enough free pages */
+#define PAGE_ERR_FRAG	3	/* enough free pages, but no run large enough */
+#define PAGE_ERR_ALIGN	4	/* runs large enough, but none aligned */
+
 extern void *page_alloc(int npages);
+extern void *page_alloc_aligned(int npages, int align_order);
+extern void *page_alloc_zeroed(int npages);
+extern int page_zero_refill(int budget);
+extern int page_errno(void);
+extern const char *page_strerror(int err);
 extern void page_free(void *p);
+extern void page_stat_dump(void);
+extern uint32_t page_init_deferred(uint32_t npages);
+extern void page_background(void);
+
+struct kmem_cache;
+extern struct kmem_cache *kmem_cache_create(const char *name, uint32_t size);
+extern int kmem_cache_destroy(struct kmem_cache *cache);
+extern void *kmem_cache_alloc(struct kmem_cache *cache);
+extern void kmem_cache_free(struct kmem_cache *cache, void *obj);
+extern void *kmalloc(uint32_t size);
+extern void kfree(void *p);
+extern void slab_dump(void);
+
+/* virtual memory (Sv32) of the user tasks */
+extern pte_t *vm_create(void);
+extern int vm_map(pte_t *pgtbl, reg_t va, reg_t pa, uint32_t size, int perm);
+extern int vm_alloc(pte_t *pgtbl, reg_t va, uint32_t size, int perm);
+extern int vm_unmap(pte_t *pgtbl, reg_t va, uint32_t size);
+extern void vm_destroy(pte_t *pgtbl);
+extern reg_t vm_translate(pte_t *pgtbl, reg_t va);
+extern int copyout(pte_t *pgtbl, reg_t dstva, const void *src, uint32_t len);
+extern int copyin(pte_t *pgtbl, void *dst, reg_t srcva, uint32_t len);
 
 /* task management */
 struct context {
@@ -59,11 +125,66 @@ struct context {
 
 	// save the pc to run in next schedule cycle
 	reg_t pc; // offset: 31 * sizeof(reg_t)
+
+	// address space of the task, written to satp by switch_to
+	reg_t satp; // offset: 32 * sizeof(reg_t)
+
+	// mstatus at the trap, the mode to return to is in MPP
+	reg_t mstatus; // offset: 33 * sizeof(reg_t)
+
+	// mcycle and minstret at the trap, for the accounting in sched.c
+	reg_t trap_mcycle; // offset: 34 * sizeof(reg_t)
+	reg_t trap_minstret; // offset: 35 * sizeof(reg_t)
+
+	// which registers are saved, CTX_FULL or CTX_CALLEE
+	reg_t kind; // offset: 36 * sizeof(reg_t)
 };
 
-extern int  task_create(void (*task)(void));
+/* kinds of a saved context */
+#define CTX_FULL 0	/* a trap frame, all registers */
+#define CTX_CALLEE 1	/* at a call, ra, sp and s0-s11 only */
+
+/* F/D registers of a task, saved and loaded lazily, see sched.c */
+struct fp_context {
+	uint64_t f[32];	// offset: 8 * i
+	reg_t fcsr;	// offset: 256
+};
+
+/* scheduling policies, see task_create() */
+#define SCHED_PRIO 0	/* fixed priority, tasks of a level take turns */
+#define SCHED_FAIR 1	/* fair share of the CPU by weight */
+#define SCHED_EDF 2	/* periodic with deadlines, before all others */
+
+/* attributes of a new task, see task_create() */
+struct task_attr {
+	void *arg;		/* argument of the task routine */
+	uint32_t stack_size;	/* in bytes, 0 for the default */
+	uint8_t priority;	/* 0 is the highest */
+	uint8_t detached;	/* reap it on exit, it can not be joined */
+	uint8_t policy;		/* SCHED_PRIO or SCHED_FAIR */
+	int8_t nice;		/* -20 ~ 19, weight of a SCHED_FAIR task */
+	uint32_t period;	/* SCHED_EDF: a job is released every period us */
+	uint32_t budget;	/* SCHED_EDF: run time of a job in us */
+	uint32_t deadline;	/* SCHED_EDF: after the release in us, 0 for period */
+};
+
+/* CPU usage of a task, see task_stat() */
+struct task_stat {
+	uint64_t cycles;	/* mcycle spent running the task itself */
+	uint64_t instret;	/* instructions retired by the task itself */
+	uint64_t trap_cycles;	/* mcycle spent in traps taken by the task */
+	uint32_t nr_voluntary;	/* switched out since it blocked */
+	uint32_t nr_preempted;	/* switched out while it could go on */
+	uint32_t stack_size;	/* in bytes */
+	uint32_t stack_used;	/* high-water mark of the stack in bytes */
+};
+
+extern int  task_create(void (*task)(void *arg), const struct task_attr *attr);
 extern void task_delay(volatile int count);
 extern void task_yield();
+extern void sched_stat_dump(void);
+extern void sched_task_dump(void);
+extern void sched_stack_dump(void);
 
 /* plic */
 extern int plic_claim(void);
@@ -73,7 +194,44 @@ extern void plic_complete(int irq);
 extern int spin_lock(void);
 extern int spin_unlock(void);
 
+struct spinlock {
+	volatile uint32_t locked;
+};
+
+extern void lock_init(struct spinlock *lk);
+extern void lock_acquire(struct spinlock *lk);
+extern int lock_tryacquire(struct spinlock *lk);
+extern void lock_release(struct spinlock *lk);
+
 /* software timer */
+
+/* interval of the timer tick, ~= 1s */
+#define TIMER_INTERVAL CLINT_TIMEBASE_FREQ
+/* time a task runs before the next one of its level gets its turn */
+#define TIME_SLICE TIMER_INTERVAL
+
+#define US_TO_MTIME(us) ((us) * (CLINT_TIMEBASE_FREQ / 1000000))
+
+/* for timer_reprogram(), there is no time slice to end */
+#define TIMER_NO_SLICE 0xffffffff
+
+/*
+ * Read the 64-bit mtime with two 32-bit loads, again if the high word
+ * has changed meanwhile. CLINT is mapped for the user tasks too.
+ */
+static inline uint64_t get_mtime()
+{
+	volatile uint32_t *p = (volatile uint32_t *)CLINT_MTIME;
+	uint32_t hi, lo;
+
+	do {
+		hi = p[1];
+		lo = p[0];
+	} while (hi != p[1]);
+
+	return ((uint64_t)hi << 32) | lo;
+}
+
 struct timer {
 	void (*func)(void *arg);
 	void *arg;
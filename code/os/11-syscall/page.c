@@ -23,48 +23,154 @@ static ptr_t _alloc_start = 0;
 static ptr_t _alloc_end = 0;
 static uint32_t _num_pages = 0;
 
-#define PAGE_SIZE 4096
-#define PAGE_ORDER 12
+/* protects the global page pool */
+static struct spinlock _pool_lock;
+/* number of free pages in the global pool, uninitialized ones included */
+static uint32_t _nr_free = 0;
 
-#define PAGE_TAKEN (uint8_t)(1 << 0)
-#define PAGE_LAST  (uint8_t)(1 << 1)
+#ifdef CONFIG_PAGE_BUDDY
+/* defined in buddy.c */
+extern void buddy_init(void *meta, ptr_t start, uint32_t npages);
+extern uint32_t buddy_grow(uint32_t npages);
+extern ptr_t buddy_alloc(int order);
+extern uint32_t buddy_free(ptr_t addr);
+extern int buddy_order(ptr_t addr);
+extern int buddy_max_free_order(void);
+#endif
 
 /*
- * Page Descriptor 
- * flags:
+ * Placement policy of the first-fit allocator: requests smaller than
+ * PAGE_TOPDOWN_PAGES pages without alignment are packed from the bottom
+ * of the heap, aligned or large requests are placed from the top down.
+ * Keeping small blocks away from the upper heap keeps large aligned
+ * regions (e.g. 4M megapages) available there.
+ * The buddy allocator needs no such policy, it always splits the smallest
+ * block which is big enough.
+ */
+#define PAGE_TOPDOWN_PAGES 32
+
+/* the largest alignment page_alloc_aligned() accepts, i.e. 64M */
+#define PAGE_MAX_ALIGN_ORDER 14
+
+/*
+ * Per-hart page caches hold blocks of order 0 to PCP_MAX_ORDER.
+ * - PCP_BATCH: number of blocks moved between a cache and the global pool
+ *   at a time.
+ * - PCP_HIGH: max number of blocks of each order a cache holds.
+ */
+#define PCP_MAX_ORDER 2
+#define PCP_BATCH 8
+#define PCP_HIGH 32
+
+/*
+ * Page descriptors of the first-fit allocator, 2 bits for each page,
+ * packed 16 to a 32-bit word:
  * - bit 0: flag if this page is taken(allocated)
  * - bit 1: flag if this page is the last page of the memory block allocated
+ * Packing the flags cuts the meta data to a quarter of a byte per page and
+ * lets page_alloc() check 16 pages with one load.
  */
-struct Page {
-	uint8_t flags;
-};
+/*
+ * With CONFIG_DEFERRED_PAGE_INIT, page_init() only initializes the page
+ * descriptors of the first PAGE_INIT_BOOT_PAGES pages. The rest is done
+ * PAGE_INIT_BATCH pages at a time by page_background(), or right away
+ * when the allocator gets to pages which are not initialized yet.
+ */
+#define PAGE_INIT_BOOT_PAGES 2048
+#define PAGE_INIT_BATCH 1024
 
-static inline void _clear(struct Page *page)
+#define PAGE_TAKEN (uint32_t)(1 << 0)
+#define PAGE_LAST  (uint32_t)(1 << 1)
+
+#define PAGE_DESC_BITS 2
+#define PAGE_DESC_PER_WORD 16
+#define PAGE_TAKEN_MASK 0x55555555	/* PAGE_TAKEN of all pages in a word */
+#define PAGE_LAST_MASK  0xaaaaaaaa	/* PAGE_LAST of all pages in a word */
+
+/* number of pages one page of meta data can describe */
+#ifdef CONFIG_PAGE_BUDDY
+/*
+ * buddy.c uses 5 bits per page, in two arrays which are rounded up to a
+ * word and a byte, keep a few bytes of each page for that
+ */
+#define PAGE_DESC_PER_PAGE ((PAGE_SIZE - 8) * 8 / 5)
+#else
+#define PAGE_DESC_PER_PAGE (PAGE_SIZE * 8 / PAGE_DESC_BITS)
+#endif
+
+static uint32_t *_desc = NULL;
+static uint32_t _num_words = 0;
+/*
+ * Descriptor words are initialized from both ends: [0, _init_words) from
+ * the bottom, where page_alloc() packs small blocks and the deferred init
+ * goes on, and [_init_top, _num_words) from the top, where aligned and
+ * large blocks are placed. So a search from the top does not initialize
+ * the whole array below it.
+ */
+static uint32_t _init_words = 0;
+static uint32_t _init_top = 0;
+
+static inline uint32_t _get_flags(uint32_t i)
 {
-	page->flags = 0;
+	return (_desc[i / PAGE_DESC_PER_WORD] >> (i % PAGE_DESC_PER_WORD * PAGE_DESC_BITS)) & 0x3;
 }
 
-static inline int _is_free(struct Page *page)
+static inline void _set_flags(uint32_t i, uint32_t flags)
 {
-	if (page->flags & PAGE_TAKEN) {
-		return 0;
-	} else {
-		return 1;
+	_desc[i / PAGE_DESC_PER_WORD] |= flags << (i % PAGE_DESC_PER_WORD * PAGE_DESC_BITS);
+}
+
+/*
+ * Initialize descriptor word w.
+ * Pages behind _num_pages in the last word don't exist, mark each of them
+ * as a taken single-page block so that searches never run past the end.
+ */
+static void _desc_clear(uint32_t w)
+{
+	_desc[w] = 0;
+
+	if (w == _num_words - 1) {
+		for (uint32_t i = _num_pages; i < _num_words * PAGE_DESC_PER_WORD; i++) {
+			_set_flags(i, PAGE_TAKEN | PAGE_LAST);
+		}
 	}
 }
 
-static inline void _set_flag(struct Page *page, uint8_t flags)
+/* initialize up to nwords more descriptor words from the bottom */
+static void _desc_init(uint32_t nwords)
 {
-	page->flags |= flags;
+	uint32_t end = _init_top - _init_words < nwords ? _init_top : _init_words + nwords;
+
+	while (_init_words < end) {
+		_desc_clear(_init_words++);
+	}
 }
 
-static inline int _is_last(struct Page *page)
+/* initialize up to nwords more descriptor words from the top */
+static void _desc_init_top(uint32_t nwords)
 {
-	if (page->flags & PAGE_LAST) {
-		return 1;
-	} else {
-		return 0;
+	uint32_t end = _init_top - _init_words < nwords ? _init_words : _init_top - nwords;
+
+	while (_init_top > end) {
+		_desc_clear(--_init_top);
+	}
+}
+
+/*
+ * read descriptor word w, initializing it on first touch, together with
+ * the words between it and the nearer initialized end
+ */
+static inline uint32_t _desc_word(uint32_t w)
+{
+	if (w >= _init_words && w < _init_top) {
+		uint32_t batch = PAGE_INIT_BATCH / PAGE_DESC_PER_WORD;
+		if (w - _init_words < _init_top - w) {
+			_desc_init(w + 1 - _init_words + batch);
+		} else {
+			_desc_init_top(_init_top - w + batch);
+		}
 	}
+	return _desc[w];
 }
 
 /*
@@ -94,41 +200,568 @@ void page_init()
 {
 	ptr_t _heap_start_aligned = _align_page(HEAP_START);
 
-	/* 
-	 * We reserved some Pages to hold the Page structures.
-	 * The number of reserved pages depends on the LENGTH_RAM.
-	 * For simplicity, the space we reserve here is just an approximation,
-	 * assuming that it can accommodate the maximum LENGTH_RAM.
-	 * We assume LENGTH_RAM should not be too small, ideally no less
-	 * than 16M (i.e. PAGE_SIZE * PAGE_SIZE).
+	lock_init(&_pool_lock);
+
+	/*
+	 * We reserve pages at the beginning of the heap to hold the page
+	 * descriptors, exactly as many as needed to describe the rest.
+	 * With T pages in total and D descriptors per page of meta data,
+	 * R = ceil(T / (D + 1)) reserved pages can describe the remaining
+	 * T - R pages, because R * (D + 1) >= T.
 	 */
-	uint32_t num_reserved_pages = LENGTH_RAM / (PAGE_SIZE * PAGE_SIZE);
+	uint32_t total_pages = (HEAP_SIZE - (_heap_start_aligned - HEAP_START)) / PAGE_SIZE;
+	uint32_t num_reserved_pages = (total_pages + PAGE_DESC_PER_PAGE) / (PAGE_DESC_PER_PAGE + 1);
 
-	_num_pages = (HEAP_SIZE - (_heap_start_aligned - HEAP_START))/ PAGE_SIZE - num_reserved_pages;
+	_num_pages = total_pages - num_reserved_pages;
 	printf("HEAP_START = %p(aligned to %p), HEAP_SIZE = 0x%lx,\n"
 	       "num of reserved pages = %d, num of pages to be allocated for heap = %d\n",
 	       HEAP_START, _heap_start_aligned, HEAP_SIZE,
 	       num_reserved_pages, _num_pages);
 	
-	/*
-	 * We use HEAP_START, not _heap_start_aligned as begin address for
-	 * allocating struct Page, because we have no requirement of alignment
-	 * for position of struct Page.
-	 */
-	struct Page *page = (struct Page *)HEAP_START;
-	for (int i = 0; i < _num_pages; i++) {
-		_clear(page);
-		page++;	
-	}
-
 	_alloc_start = _heap_start_aligned + num_reserved_pages * PAGE_SIZE;
 	_alloc_end = _alloc_start + (PAGE_SIZE * _num_pages);
+	_nr_free = _num_pages;
+
+	/*
+	 * The descriptors start at _heap_start_aligned, so the packed
+	 * words are naturally aligned.
+	 */
+#ifdef CONFIG_DEFERRED_PAGE_INIT
+	uint32_t boot_pages = PAGE_INIT_BOOT_PAGES;
+#else
+	uint32_t boot_pages = _num_pages;
+#endif
+#ifdef CONFIG_PAGE_BUDDY
+	buddy_init((uint8_t *)_heap_start_aligned, _alloc_start, _num_pages);
+	buddy_grow(boot_pages);
+#else
+	_desc = (uint32_t *)_heap_start_aligned;
+	_num_words = (_num_pages + PAGE_DESC_PER_WORD - 1) / PAGE_DESC_PER_WORD;
+	_init_top = _num_words;
+	_desc_init((boot_pages + PAGE_DESC_PER_WORD - 1) / PAGE_DESC_PER_WORD);
+#endif
 
 	printf("TEXT:   %p -> %p\n", TEXT_START, TEXT_END);
 	printf("RODATA: %p -> %p\n", RODATA_START, RODATA_END);
 	printf("DATA:   %p -> %p\n", DATA_START, DATA_END);
 	printf("BSS:    %p -> %p\n", BSS_START, BSS_END);
 	printf("HEAP:   %p -> %p\n", _alloc_start, _alloc_end);
+#ifdef CONFIG_PAGE_BUDDY
+	printf("page allocator: buddy\n");
+#else
+	printf("page allocator: first-fit\n");
+#endif
+}
+
+/*
+ * get the order of the smallest power-of-2 block which can hold npages pages
+ */
+static inline int _order_of(int npages)
+{
+	int order = 0;
+	while ((1 << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+/*
+ * The global page pool, callers must hold _pool_lock.
+ * - _pool_alloc(): allocate npages contiguous pages, the first one aligned
+ *   to (PAGE_SIZE << align_order)
+ * - _pool_free(): free a block allocated by _pool_alloc()
+ * - _pool_order(): order of the allocated block at p if the block is
+ *   exactly 2^order pages, otherwise -1
+ * - _pool_can_fit(): check if there is a free run of npages at all,
+ *   ignoring the alignment
+ * - _pool_max_pages(): the largest block the pool can ever hand out
+ */
+#ifdef CONFIG_PAGE_BUDDY
+/*
+ * Note the buddy allocator rounds npages up to a power of 2, and a block
+ * is always aligned to its size.
+ */
+static void *_pool_alloc(int npages, int align_order)
+{
+	int order = _order_of(npages);
+	if (order < align_order) {
+		order = align_order;
+	}
+
+	ptr_t p = buddy_alloc(order);
+	if (p) {
+		_nr_free -= 1 << order;
+	}
+	return (void *)p;
+}
+
+static void _pool_free(void *p)
+{
+	_nr_free += buddy_free((ptr_t)p);
+}
+
+static int _pool_can_fit(int npages)
+{
+	return buddy_max_free_order() >= _order_of(npages);
+}
+
+static uint32_t _pool_max_pages(void)
+{
+	/* the largest power of 2 in the pool, up to BUDDY_MAX_ORDER in buddy.c */
+	int order = PAGE_MAX_ALIGN_ORDER;
+	while (order > 0 && (1 << order) > _num_pages) {
+		order--;
+	}
+	return 1 << order;
+}
+
+static int _pool_order(void *p)
+{
+	return buddy_order((ptr_t)p);
+}
+#else
+/*
+ * index of the first free page at or behind page i, or _num_pages if
+ * there is none.
+ */
+static uint32_t _next_free(uint32_t i)
+{
+	uint32_t w = i / PAGE_DESC_PER_WORD;
+	uint32_t free = ~_desc_word(w) & PAGE_TAKEN_MASK;
+
+	/* ignore pages in front of i */
+	free &= PAGE_TAKEN_MASK << (i % PAGE_DESC_PER_WORD * PAGE_DESC_BITS);
+	while (!free) {
+		if (++w >= _num_words) {
+			return _num_pages;
+		}
+		free = ~_desc_word(w) & PAGE_TAKEN_MASK;
+	}
+	return w * PAGE_DESC_PER_WORD + ctz32(free) / PAGE_DESC_BITS;
+}
+
+/*
+ * index of the first taken page at or behind page i, looking no further
+ * than page limit.
+ */
+static uint32_t _next_taken(uint32_t i, uint32_t limit)
+{
+	uint32_t w = i / PAGE_DESC_PER_WORD;
+	uint32_t taken = _desc_word(w) & PAGE_TAKEN_MASK;
+
+	taken &= PAGE_TAKEN_MASK << (i % PAGE_DESC_PER_WORD * PAGE_DESC_BITS);
+	while (!taken) {
+		if (++w * PAGE_DESC_PER_WORD >= limit) {
+			return limit;
+		}
+		taken = _desc_word(w) & PAGE_TAKEN_MASK;
+	}
+
+	i = w * PAGE_DESC_PER_WORD + ctz32(taken) / PAGE_DESC_BITS;
+	return i < limit ? i : limit;
+}
+
+/* mark pages [i, i + npages) as a taken block */
+static void _take(uint32_t i, uint32_t npages)
+{
+	uint32_t last = i + npages - 1;
+
+	while (npages) {
+		uint32_t w = i / PAGE_DESC_PER_WORD;
+		uint32_t off = i % PAGE_DESC_PER_WORD;
+		uint32_t n = PAGE_DESC_PER_WORD - off;
+		if (n > npages) {
+			n = npages;
+		}
+
+		uint32_t mask = PAGE_TAKEN_MASK;
+		if (n < PAGE_DESC_PER_WORD) {
+			mask &= (1 << (n * PAGE_DESC_BITS)) - 1;
+		}
+		_desc[w] |= mask << (off * PAGE_DESC_BITS);
+
+		i += n;
+		npages -= n;
+	}
+	_set_flags(last, PAGE_LAST);
+}
+
+/*
+ * Find a free run of npages at the lowest address.
+ * Note we are searching the page descriptor bitmaps, a word (16 pages)
+ * at a time: skip to the next free page, then measure the free run from
+ * there. If it is too short, go on from the taken page which ends it.
+ * RETURN VALUE: index of the first page of the run, or -1.
+ */
+static int _find_bottom_up(uint32_t npages)
+{
+	uint32_t i = 0;
+	while (i + npages <= _num_pages) {
+		i = _next_free(i);
+		if (i + npages > _num_pages) {
+			break;
+		}
+
+		uint32_t end = _next_taken(i, i + npages);
+		if (end - i == npages) {
+			return i;
+		}
+		i = end;
+	}
+	return -1;
+}
+
+/*
+ * Find a free run of npages at the highest address whose first page is
+ * aligned to 2^align_order pages (in physical address).
+ * RETURN VALUE: index of the first page of the run, or -1.
+ */
+static int _find_top_down(uint32_t npages, int align_order)
+{
+	uint32_t mask = (1 << align_order) - 1;
+	uint32_t pfn = _alloc_start >> PAGE_ORDER;
+
+	if (npages > _num_pages) {
+		return -1;
+	}
+
+	uint32_t x = _num_pages - npages;
+	for (;;) {
+		/* align x down, in physical page frame numbers */
+		if (((pfn + x) & ~mask) < pfn) {
+			return -1;
+		}
+		uint32_t i = ((pfn + x) & ~mask) - pfn;
+
+		uint32_t end = _next_taken(i, i + npages);
+		if (end - i == npages) {
+			return i;
+		}
+
+		/* every candidate covering the taken page fails, go below it */
+		if (end < npages) {
+			return -1;
+		}
+		x = end - npages;
+	}
+}
+
+static void *_pool_alloc(int npages, int align_order)
+{
+	int i;
+	if (align_order == 0 && npages < PAGE_TOPDOWN_PAGES) {
+		i = _find_bottom_up(npages);
+	} else {
+		i = _find_top_down(npages, align_order);
+	}
+	if (i < 0) {
+		return NULL;
+	}
+
+	_take(i, npages);
+	_nr_free -= npages;
+	return (void *)(_alloc_start + i * PAGE_SIZE);
+}
+
+static void _pool_free(void *p)
+{
+	uint32_t first = ((ptr_t)p - _alloc_start) / PAGE_SIZE;
+	uint32_t i = first;
+	if (!(_get_flags(i) & PAGE_TAKEN)) {
+		return;
+	}
+
+	/* clear the descriptors word by word till the last page of the block */
+	for (;;) {
+		uint32_t w = i / PAGE_DESC_PER_WORD;
+		uint32_t mask = 0xffffffff << (i % PAGE_DESC_PER_WORD * PAGE_DESC_BITS);
+		uint32_t last = _desc[w] & PAGE_LAST_MASK & mask;
+		if (last) {
+			int bit = ctz32(last);
+			if (bit < 31) {
+				mask &= (1 << (bit + 1)) - 1;
+			}
+			_desc[w] &= ~mask;
+			_nr_free += w * PAGE_DESC_PER_WORD + bit / PAGE_DESC_BITS - first + 1;
+			return;
+		}
+		_desc[w] &= ~mask;
+		i = (w + 1) * PAGE_DESC_PER_WORD;
+	}
+}
+
+static int _pool_can_fit(int npages)
+{
+	return _find_bottom_up(npages) >= 0;
+}
+
+static uint32_t _pool_max_pages(void)
+{
+	return _num_pages;
+}
+
+static int _pool_order(void *p)
+{
+	uint32_t i = ((ptr_t)p - _alloc_start) / PAGE_SIZE;
+
+	/* only small blocks are of interest, give up after PCP_MAX_ORDER */
+	for (int n = 1; n <= (1 << PCP_MAX_ORDER); n++, i++) {
+		uint32_t flags = _get_flags(i);
+		if (!(flags & PAGE_TAKEN)) {
+			return -1;
+		}
+		if (flags & PAGE_LAST) {
+			int order = _order_of(n);
+			return (1 << order) == n ? order : -1;
+		}
+	}
+	return -1;
+}
+#endif /* CONFIG_PAGE_BUDDY */
+
+/*
+ * Per-hart page caches
+ *
+ * Each hart keeps stacks of free blocks of 1, 2 and 4 pages (order 0 to
+ * PCP_MAX_ORDER). page_alloc()/page_free() of such a block is served from
+ * the cache of the current hart without touching the global pool. Only when
+ * a cache runs empty or full, PCP_BATCH blocks are moved from or to the
+ * global pool under _pool_lock in one go.
+ * Blocks sitting in a cache are still "allocated" as far as the global pool
+ * is concerned.
+ */
+struct page_pcp {
+	void *blocks[PCP_MAX_ORDER + 1][PCP_HIGH];
+	int count[PCP_MAX_ORDER + 1];
+	uint32_t hit;
+	uint32_t miss;
+	uint32_t refill;
+	uint32_t drain;
+};
+
+static struct page_pcp _pcp[MAXNUM_CPU];
+
+/*
+ * get the cache order for a request of npages, or -1 if the request
+ * should go to the global pool directly.
+ */
+static inline int _pcp_order(int npages)
+{
+	int order = _order_of(npages);
+	if (order > PCP_MAX_ORDER) {
+		return -1;
+	}
+#ifndef CONFIG_PAGE_BUDDY
+	/* first-fit blocks are not rounded up, only cache exact sizes */
+	if ((1 << order) != npages) {
+		return -1;
+	}
+#endif
+	return order;
+}
+
+static void _pcp_refill(struct page_pcp *pcp, int order)
+{
+	lock_acquire(&_pool_lock);
+	while (pcp->count[order] < PCP_BATCH) {
+		void *p = _pool_alloc(1 << order, 0);
+		if (!p) {
+			break;
+		}
+		pcp->blocks[order][pcp->count[order]++] = p;
+	}
+	lock_release(&_pool_lock);
+	pcp->refill++;
+}
+
+static void _pcp_drain(struct page_pcp *pcp, int order)
+{
+	lock_acquire(&_pool_lock);
+	for (int i = 0; i < PCP_BATCH && pcp->count[order] > 0; i++) {
+		_pool_free(pcp->blocks[order][--pcp->count[order]]);
+	}
+	lock_release(&_pool_lock);
+	pcp->drain++;
+}
+
+/* give all blocks of a cache back, return the number of blocks */
+static int _pcp_drain_all(struct page_pcp *pcp)
+{
+	int n = 0;
+
+	lock_acquire(&_pool_lock);
+	for (int order = 0; order <= PCP_MAX_ORDER; order++) {
+		while (pcp->count[order] > 0) {
+			_pool_free(pcp->blocks[order][--pcp->count[order]]);
+			n++;
+		}
+	}
+	lock_release(&_pool_lock);
+
+	if (n) {
+		pcp->drain++;
+	}
+	return n;
+}
+
+/*
+ * Pool of pre-zeroed pages for page_alloc_zeroed(). The pages are
+ * allocated from the global pool and zeroed by page_zero_refill() in the
+ * background, so page_alloc_zeroed(1) only pops one off the pool. If the
+ * pool is empty the page is zeroed inline.
+ * The pool is kept only while free memory is above ZPOOL_LOW pages, and
+ * it is given back when an allocation would fail otherwise.
+ */
+#define ZPOOL_SIZE 32
+#define ZPOOL_LOW (ZPOOL_SIZE * 4)
+/* pages zeroed in each call of page_background() */
+#define ZPOOL_REFILL_BATCH 2
+
+static struct {
+	struct spinlock lock;
+	void *pages[ZPOOL_SIZE];
+	int count;
+	uint32_t hit;
+	uint32_t miss;
+	uint32_t zeroed;
+} _zpool;
+
+/* zero npages pages at p, 8 words per iteration */
+static void _zero_pages(void *p, int npages)
+{
+	uint32_t *w = (uint32_t *)p;
+	uint32_t *end = w + npages * (PAGE_SIZE / sizeof(uint32_t));
+
+	while (w < end) {
+		w[0] = 0;
+		w[1] = 0;
+		w[2] = 0;
+		w[3] = 0;
+		w[4] = 0;
+		w[5] = 0;
+		w[6] = 0;
+		w[7] = 0;
+		w += 8;
+	}
+}
+
+/* give all pre-zeroed pages back, return the number of pages */
+static int _zpool_release()
+{
+	int n;
+
+	lock_acquire(&_zpool.lock);
+	lock_acquire(&_pool_lock);
+	n = _zpool.count;
+	while (_zpool.count > 0) {
+		_pool_free(_zpool.pages[--_zpool.count]);
+	}
+	lock_release(&_pool_lock);
+	lock_release(&_zpool.lock);
+
+	return n;
+}
+
+/* reason of the last failed allocation on each hart */
+static int _page_errno[MAXNUM_CPU];
+
+static void *_alloc_global(int npages, int align_order)
+{
+	lock_acquire(&_pool_lock);
+	void *p = _pool_alloc(npages, align_order);
+	lock_release(&_pool_lock);
+	return p;
+}
+
+/*
+ * The cache of a hart is only touched by the hart itself, and with
+ * mstatus.MIE clear, so that no trap can get in and use the same cache,
+ * or move the caller to another hart, halfway through. Trap handlers run
+ * with MIE clear anyway, but tasks in M-mode (without CONFIG_SYSCALL) run
+ * with it set, so page_alloc_aligned() and page_free() clear it while they
+ * run.
+ */
+static inline reg_t _irq_save(void)
+{
+	reg_t mstatus = r_mstatus();
+	w_mstatus(mstatus & ~MSTATUS_MIE);
+	return mstatus;
+}
+
+static inline void _irq_restore(reg_t mstatus)
+{
+	if (mstatus & MSTATUS_MIE) {
+		w_mstatus(r_mstatus() | MSTATUS_MIE);
+	}
+}
+
+static void *_page_alloc(int hart, int npages, int align_order)
+{
+	void *p;
+
+	if (npages <= 0 || align_order < 0 || align_order > PAGE_MAX_ALIGN_ORDER
+	    || npages > _pool_max_pages()) {
+		/* can not be satisfied, however many pages are free */
+		_page_errno[hart] = PAGE_ERR_INVAL;
+		return NULL;
+	}
+
+	struct page_pcp *pcp = &_pcp[hart];
+	int order = align_order == 0 ? _pcp_order(npages) : -1;
+	if (order >= 0) {
+		if (pcp->count[order] > 0) {
+			pcp->hit++;
+			return pcp->blocks[order][--pcp->count[order]];
+		}
+		pcp->miss++;
+		_pcp_refill(pcp, order);
+		if (pcp->count[order] > 0) {
+			return pcp->blocks[order][--pcp->count[order]];
+		}
+	}
+
+	p = _alloc_global(npages, align_order);
+	if (!p && _pcp_drain_all(pcp)) {
+		/* the blocks held in our cache may be just what is missing */
+		p = _alloc_global(npages, align_order);
+	}
+	if (!p && _zpool_release()) {
+		p = _alloc_global(npages, align_order);
+	}
+	if (p) {
+		return p;
+	}
+
+	lock_acquire(&_pool_lock);
+	if (_nr_free < npages) {
+		_page_errno[hart] = PAGE_ERR_NOMEM;
+	} else if (align_order && _pool_can_fit(npages)) {
+		_page_errno[hart] = PAGE_ERR_ALIGN;
+	} else {
+		_page_errno[hart] = PAGE_ERR_FRAG;
+	}
+	lock_release(&_pool_lock);
+	return NULL;
+}
+
+/*
+ * DESCRIPTION
+ * 	Allocate a memory block which is composed of contiguous physical
+ * 	pages, with the address of the first page aligned to
+ * 	(PAGE_SIZE << align_order).
+ * 	- npages: the number of PAGE_SIZE pages to allocate
+ * 	- align_order: e.g. 0 for any page, MEGAPAGE_ORDER for a 4M aligned
+ * 	  block which can be mapped with an Sv32 megapage
+ * RETURN VALUE
+ * 	start address of the block, or NULL with the reason available from
+ * 	page_errno().
+ */
+void *page_alloc_aligned(int npages, int align_order)
+{
+	reg_t mstatus = _irq_save();
+	void *p = _page_alloc(r_tp(), npages, align_order);
+	_irq_restore(mstatus);
+	return p;
 }
 
 /*
@@ -137,43 +770,123 @@ void page_init()
  */
 void *page_alloc(int npages)
 {
-	/* Note we are searching the page descriptor bitmaps. */
-	int found = 0;
-	struct Page *page_i = (struct Page *)HEAP_START;
-	for (int i = 0; i <= (_num_pages - npages); i++) {
-		if (_is_free(page_i)) {
-			found = 1;
-			/* 
-			 * meet a free page, continue to check if following
-			 * (npages - 1) pages are also unallocated.
-			 */
-			struct Page *page_j = page_i + 1;
-			for (int j = i + 1; j < (i + npages); j++) {
-				if (!_is_free(page_j)) {
-					found = 0;
-					break;
-				}
-				page_j++;
-			}
-			/*
-			 * get a memory block which is good enough for us,
-			 * take housekeeping, then return the actual start
-			 * address of the first page of this memory block
-			 */
-			if (found) {
-				struct Page *page_k = page_i;
-				for (int k = i; k < (i + npages); k++) {
-					_set_flag(page_k, PAGE_TAKEN);
-					page_k++;
-				}
-				page_k--;
-				_set_flag(page_k, PAGE_LAST);
-				return (void *)(_alloc_start + i * PAGE_SIZE);
-			}
+	return page_alloc_aligned(npages, 0);
+}
+
+/*
+ * DESCRIPTION
+ * 	Allocate npages contiguous pages filled with zeros.
+ * 	Single pages come from the pool of pre-zeroed pages when possible,
+ * 	anything else is zeroed here.
+ * RETURN VALUE
+ * 	start address of the block, or NULL as page_alloc().
+ */
+void *page_alloc_zeroed(int npages)
+{
+	void *p = NULL;
+
+	if (npages == 1) {
+		lock_acquire(&_zpool.lock);
+		if (_zpool.count > 0) {
+			p = _zpool.pages[--_zpool.count];
+			_zpool.hit++;
+		} else {
+			_zpool.miss++;
+		}
+		lock_release(&_zpool.lock);
+		if (p) {
+			return p;
 		}
-		page_i++;
 	}
-	return NULL;
+
+	p = page_alloc(npages);
+	if (p) {
+		_zero_pages(p, npages);
+	}
+	return p;
+}
+
+/*
+ * DESCRIPTION
+ * 	Zero up to budget pages into the pool of pre-zeroed pages.
+ * 	It is called from page_background(), but can be called by anyone who
+ * 	is about to need many zeroed pages.
+ * RETURN VALUE
+ * 	number of pages zeroed.
+ */
+int page_zero_refill(int budget)
+{
+	int n = 0;
+
+	while (n < budget && _zpool.count < ZPOOL_SIZE && _nr_free > ZPOOL_LOW) {
+		void *p = page_alloc(1);
+		if (!p) {
+			break;
+		}
+		_zero_pages(p, 1);
+		n++;
+
+		lock_acquire(&_zpool.lock);
+		if (_zpool.count < ZPOOL_SIZE) {
+			_zpool.pages[_zpool.count++] = p;
+			_zpool.zeroed++;
+			p = NULL;
+		}
+		lock_release(&_zpool.lock);
+
+		/* somebody else filled the pool meanwhile */
+		if (p) {
+			page_free(p);
+			break;
+		}
+	}
+
+	return n;
+}
+
+/* reason of the last failed allocation on the current hart */
+int page_errno()
+{
+	return _page_errno[r_tp()];
+}
+
+const char *page_strerror(int err)
+{
+	switch (err) {
+	case PAGE_ERR_NONE:
+		return "no error";
+	case PAGE_ERR_INVAL:
+		return "invalid size or alignment";
+	case PAGE_ERR_NOMEM:
+		return "not enough free pages";
+	case PAGE_ERR_FRAG:
+		return "no contiguous run of free pages large enough";
+	case PAGE_ERR_ALIGN:
+		return "no free run with the required alignment";
+	default:
+		return "unknown error";
+	}
+}
+
+static void _page_free(int hart, void *p)
+{
+	/*
+	 * Only the owner of the block reads its descriptors here, nobody
+	 * else writes them while the block is allocated.
+	 */
+	int order = _pool_order(p);
+	if (order >= 0 && order <= PCP_MAX_ORDER) {
+		struct page_pcp *pcp = &_pcp[hart];
+		if (pcp->count[order] == PCP_HIGH) {
+			_pcp_drain(pcp, order);
+		}
+		pcp->blocks[order][pcp->count[order]++] = p;
+		return;
+	}
+
+	lock_acquire(&_pool_lock);
+	_pool_free(p);
+	lock_release(&_pool_lock);
 }
 
 /*
@@ -185,22 +898,66 @@ void page_free(void *p)
 	/*
 	 * Assert (TBD) if p is invalid
 	 */
-	if (!p || (ptr_t)p >= _alloc_end) {
+	if (!p || (ptr_t)p < _alloc_start || (ptr_t)p >= _alloc_end) {
 		return;
 	}
-	/* get the first page descriptor of this memory block */
-	struct Page *page = (struct Page *)HEAP_START;
-	page += ((ptr_t)p - _alloc_start)/ PAGE_SIZE;
-	/* loop and clear all the page descriptors of the memory block */
-	while (!_is_free(page)) {
-		if (_is_last(page)) {
-			_clear(page);
-			break;
-		} else {
-			_clear(page);
-			page++;;
+
+	reg_t mstatus = _irq_save();
+	_page_free(r_tp(), p);
+	_irq_restore(mstatus);
+}
+
+/*
+ * DESCRIPTION
+ * 	Initialize the page descriptors of up to npages more pages.
+ * RETURN VALUE
+ * 	number of pages still left uninitialized.
+ */
+uint32_t page_init_deferred(uint32_t npages)
+{
+	uint32_t left;
+
+	lock_acquire(&_pool_lock);
+#ifdef CONFIG_PAGE_BUDDY
+	left = buddy_grow(npages);
+#else
+	_desc_init((npages + PAGE_DESC_PER_WORD - 1) / PAGE_DESC_PER_WORD);
+	left = (_init_top - _init_words) * PAGE_DESC_PER_WORD;
+#endif
+	lock_release(&_pool_lock);
+
+	return left;
+}
+
+/*
+ * Deferred work of the page allocator, to be called when there is
+ * nothing better to do. It must not be called with _pool_lock held.
+ */
+void page_background()
+{
+	static int done = 0;
+
+	if (!done && page_init_deferred(PAGE_INIT_BATCH) == 0) {
+		done = 1;
+		boot_mark("page_init_deferred");
+	}
+
+	page_zero_refill(ZPOOL_REFILL_BATCH);
+}
+
+void page_stat_dump()
+{
+	printf("free pages: %d of %d\n", _nr_free, _num_pages);
+	printf("hart  pcp-hit  pcp-miss  refill  drain\n");
+	for (int i = 0; i < MAXNUM_CPU; i++) {
+		struct page_pcp *pcp = &_pcp[i];
+		if (pcp->hit || pcp->miss) {
+			printf("%d\t%d\t%d\t%d\t%d\n",
+			       i, pcp->hit, pcp->miss, pcp->refill, pcp->drain);
 		}
 	}
+	printf("zeroed pool: %d pages, hit %d, miss %d, zeroed %d\n",
+	       _zpool.count, _zpool.hit, _zpool.miss, _zpool.zeroed);
 }
 
 void page_test()
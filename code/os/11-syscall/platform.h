@@ -12,8 +12,27 @@
  */
 #define MAXNUM_CPU 8
 
+/* number of harts the kernel brings up, set by "make NCPU=<n>" */
+#ifndef NCPU
+#define NCPU 1
+#endif
+#if NCPU < 1 || NCPU > MAXNUM_CPU
+#error "NCPU must be in 1..MAXNUM_CPU"
+#endif
+
 /* used in os.ld */
 #define LENGTH_RAM 128*1024*1024
+#define RAM_BASE 0x80000000L
+
+/*
+ * Each hart has a kernel stack of KSTACK_SIZE bytes in start.S, used by
+ * the boot code and then by the trap handler.
+ */
+#define KSTACK_ORDER 11
+#define KSTACK_SIZE (1 << KSTACK_ORDER)
+
+/* stacks are filled with this word when they are set up, see sched.c */
+#define STACK_PAINT 0x5a5aa5a5
 
 /*
  * MemoryMap
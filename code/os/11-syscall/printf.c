@@ -1,4 +1,5 @@
 #include "os.h"
+#include "user_api.h"
 
 /*
  * ref: https://github.com/cccriscv/mini-riscv-os/blob/master/05-Preemptive/lib.c
@@ -105,20 +106,87 @@ static int _vsnprintf(char * out, size_t n, const char* s, va_list vl)
 	return pos;
 }
 
-static char out_buf[1000]; // buffer for _vprintf()
+/*
+ * Each caller formats into a buffer on its own stack, output longer than
+ * the buffer is cut. The kernel prints under _print_lock, so lines of
+ * different harts don't mix, with interrupts off while it holds the lock:
+ * the holder is never preempted, and a trap handler never finds the lock
+ * taken on its own hart.
+ * A task in U-mode can not turn interrupts off, nor may it spin on a lock
+ * which trap handlers take. So it hands the line to the uart_write
+ * syscall, which prints it from M-mode.
+ */
+#define PRINT_BUF_SIZE 256
+
+static struct spinlock _print_lock;
+
+static inline int _in_user()
+{
+#ifdef CONFIG_SYSCALL
+	/* task stacks are right below RAM, see USTACK_TOP in sched.c */
+	return r_sp() < RAM_BASE;
+#else
+	return 0;
+#endif
+}
+
+static void _puts_locked(char *s)
+{
+	reg_t mstatus = r_mstatus();
+
+	w_mstatus(mstatus & ~MSTATUS_MIE);
+	lock_acquire(&_print_lock);
+	uart_puts(s);
+	lock_release(&_print_lock);
+	if (mstatus & MSTATUS_MIE) {
+		w_mstatus(r_mstatus() | MSTATUS_MIE);
+	}
+}
 
 static int _vprintf(const char* s, va_list vl)
 {
-	int res = _vsnprintf(NULL, -1, s, vl);
-	if (res+1 >= sizeof(out_buf)) {
-		uart_puts("error: output string size overflow\n");
-		while(1) {}
+	char out_buf[PRINT_BUF_SIZE];
+	int res = _vsnprintf(out_buf, sizeof(out_buf), s, vl);
+
+#ifdef CONFIG_SYSCALL
+	if (_in_user()) {
+		uart_write(out_buf, res < sizeof(out_buf) ? res : sizeof(out_buf) - 1);
+		return res;
 	}
-	_vsnprintf(out_buf, res + 1, s, vl);
-	uart_puts(out_buf);
+#endif
+	_puts_locked(out_buf);
 	return res;
 }
 
+#ifdef CONFIG_SYSCALL
+/*
+ * DESCRIPTION
+ * 	Called by the uart_write syscall, print len bytes at the user
+ * 	address buf. The bytes are copied in and printed a buffer at a time.
+ * RETURN VALUE
+ * 	number of bytes printed, or -1 if buf is not readable.
+ */
+int sys_uart_write(reg_t buf, uint32_t len)
+{
+	char out_buf[PRINT_BUF_SIZE];
+	uint32_t done = 0;
+
+	while (done < len) {
+		uint32_t n = len - done;
+		if (n > sizeof(out_buf) - 1) {
+			n = sizeof(out_buf) - 1;
+		}
+		if (copyin(SATP_PGTBL(r_satp()), out_buf, buf + done, n) < 0) {
+			return done ? done : -1;
+		}
+		out_buf[n] = 0;
+		_puts_locked(out_buf);
+		done += n;
+	}
+	return done;
+}
+#endif
+
 int printf(const char* s, ...)
 {
 	int res = 0;
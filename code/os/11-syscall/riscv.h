@@ -14,6 +14,13 @@ static inline reg_t r_tp()
 	return x;
 }
 
+static inline reg_t r_sp()
+{
+	reg_t x;
+	asm volatile("mv %0, sp" : "=r" (x) );
+	return x;
+}
+
 /* which hart (core) is this? */
 static inline reg_t r_mhartid()
 {
@@ -30,6 +37,13 @@ static inline reg_t r_mhartid()
 #define MSTATUS_SPIE (1 << 5)
 #define MSTATUS_UPIE (1 << 4)
 
+/* state of the F/D registers, written as Dirty by the hardware */
+#define MSTATUS_FS (3 << 13)
+#define MSTATUS_FS_OFF (0 << 13)	/* FP instructions are illegal */
+#define MSTATUS_FS_INITIAL (1 << 13)
+#define MSTATUS_FS_CLEAN (2 << 13)
+#define MSTATUS_FS_DIRTY (3 << 13)
+
 #define MSTATUS_MIE (1 << 3)
 #define MSTATUS_SIE (1 << 1)
 #define MSTATUS_UIE (1 << 0)
@@ -103,4 +117,78 @@ static inline reg_t r_mcause()
 	return x;
 }
 
+/* Machine-mode trap value, e.g. the faulting address of a page fault */
+static inline reg_t r_mtval()
+{
+	reg_t x;
+	asm volatile("csrr %0, mtval" : "=r" (x) );
+	return x;
+}
+
+/* Machine-mode cycle and instructions-retired counters */
+static inline reg_t r_mcycle()
+{
+	reg_t x;
+	asm volatile("csrr %0, mcycle" : "=r" (x) );
+	return x;
+}
+
+static inline reg_t r_minstret()
+{
+	reg_t x;
+	asm volatile("csrr %0, minstret" : "=r" (x) );
+	return x;
+}
+
+/*
+ * Supervisor address translation and protection, satp.
+ * Only U-mode accesses are translated here, the kernel runs in M-mode
+ * and always sees physical addresses.
+ */
+#define SATP_SV32 (1L << 31)
+#define SATP_PPN_MASK 0x3fffff
+#define MAKE_SATP(pgtbl) (SATP_SV32 | (((reg_t)(pgtbl)) >> 12))
+#define SATP_PGTBL(satp) ((pte_t *)(((satp) & SATP_PPN_MASK) << 12))
+
+static inline void w_satp(reg_t x)
+{
+	asm volatile("csrw satp, %0" : : "r" (x));
+}
+
+static inline reg_t r_satp()
+{
+	reg_t x;
+	asm volatile("csrr %0, satp" : "=r" (x) );
+	return x;
+}
+
+/* flush all TLB entries */
+static inline void sfence_vma()
+{
+	asm volatile("sfence.vma zero, zero");
+}
+
+/* Sv32 page table entry */
+typedef uint32_t pte_t;
+
+#define PTE_V (1 << 0)	/* valid */
+#define PTE_R (1 << 1)
+#define PTE_W (1 << 2)
+#define PTE_X (1 << 3)
+#define PTE_U (1 << 4)	/* user can access */
+#define PTE_G (1 << 5)	/* global */
+#define PTE_A (1 << 6)	/* accessed */
+#define PTE_D (1 << 7)	/* dirty */
+#define PTE_OWNED (1 << 8)	/* RSW: the page is freed when it is unmapped */
+
+#define PTE_FLAGS(pte) ((pte) & 0x3ff)
+#define PTE_LEAF(pte) ((pte) & (PTE_R | PTE_W | PTE_X))
+#define PA2PTE(pa) ((((reg_t)(pa)) >> 12) << 10)
+#define PTE2PA(pte) (((pte) >> 10) << 12)
+
+/* index of va in the page table of the level, 1 for the root */
+#define PX(level, va) ((((reg_t)(va)) >> (12 + 10 * (level))) & 0x3ff)
+
+#define MEGAPAGE_SIZE (1 << 22)
+
 #endif /* __RISCV_H__ */
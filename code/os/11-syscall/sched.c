@@ -1,77 +1,1644 @@
 #include "os.h"
+#include "user_api.h"
 
 /* defined in entry.S */
 extern void switch_to(struct context *next);
+extern void fp_save(struct fp_context *fp);
+extern void fp_restore(struct fp_context *fp);
+/* defined in start.S, the kernel stacks of the harts */
+extern uint32_t stacks[];
+/* defined in usys.S, a task returning from its routine goes there */
+extern void task_return(void);
+#ifdef CONFIG_TICKLESS
+/* defined in timer.c */
+extern void timer_reprogram(uint32_t slice);
+#endif
 
-#define MAX_TASKS 10
-#define STACK_SIZE 1024
+#ifdef CONFIG_SYSCALL
 /*
- * In the standard RISC-V calling convention, the stack pointer sp
- * is always 16-byte aligned.
+ * Task stacks live in the address space of each task, right below RAM,
+ * so every task uses the same virtual range. A stack starts with one
+ * page and grows on page faults, up to the stack size of the task. Below
+ * that is the guard region, which is never mapped, so an overflow faults
+ * instead of silently corrupting memory.
+ * Pages more than USTACK_SLACK_PAGES below the sp of a task are given
+ * back when the task is switched out, so a stack shrinks again after a
+ * deep call chain returns.
  */
-uint8_t __attribute__((aligned(16))) task_stack[MAX_TASKS][STACK_SIZE];
-struct context ctx_tasks[MAX_TASKS];
+#define USTACK_TOP RAM_BASE
+#define USTACK_SLACK_PAGES 1
+#endif
+
+/* default and largest stack size of a task */
+#define STACK_SIZE_DEFAULT (64 * PAGE_SIZE)
+#define STACK_SIZE_MAX (4 * 1024 * 1024)
 
 /*
- * _top is used to mark the max available position of ctx_tasks
- * _current is used to point to the context of current task
+ * Priority levels, 0 is the highest priority.
+ * Each level has a FIFO queue of ready tasks, and bit (31 - prio) of
+ * ready_bitmap is set if the queue of level prio is not empty, so the
+ * highest ready level is found with a single clz32(), however many tasks
+ * there are. Tasks of the same level take turns, a lower level runs only
+ * when no higher level is ready.
+ * Every hart has its own set of queues, see struct cpu.
  */
-static int _top = 0;
-static int _current = -1;
+#define PRIO_LEVELS 32
+#define PRIO_DEFAULT 16
 
-void sched_init()
+/*
+ * SCHED_FAIR tasks run below all priority levels, when no SCHED_PRIO
+ * task is ready, and share the CPU by weight among themselves.
+ * Each task has a virtual runtime, the mtime it has run scaled by
+ * 1024 / weight, and the task with the smallest one runs next. Each
+ * hart keeps its ready SCHED_FAIR tasks in a leftist min-heap ordered by
+ * vruntime, with O(log n) insert and pop, and no limit on the number of
+ * tasks since the links are in the tasks.
+ * The weight of nice 0 is 1024, and each nice level is ~1.25 times the
+ * weight of the next one, so a task gets ~10% more CPU than a task one
+ * nice level above it.
+ */
+#define PRIO_FAIR PRIO_LEVELS		/* priority of all SCHED_FAIR tasks */
+#define PRIO_IDLE (PRIO_LEVELS + 1)	/* priority of the idle tasks */
+
+#define NICE_MIN (-20)
+#define NICE_MAX 19
+
+/*
+ * vruntime a woken up task may lag behind the hart's min_vruntime, so
+ * that a task which has slept gets the CPU soon, but it can not run for
+ * long on the credit of a long sleep.
+ */
+#define FAIR_WAKEUP_CREDIT (TIME_SLICE / 2)
+
+/*
+ * 2^32 / weight for nice -20 ~ 19, a run of delta mtime adds
+ * (delta * wmult) >> 22 = delta * 1024 / weight to the vruntime.
+ */
+static const uint32_t _nice_to_wmult[NICE_MAX - NICE_MIN + 1] = {
+	/* -20 */ 48388, 59856, 76039, 92817, 118348,
+	/* -15 */ 147320, 184698, 229616, 287308, 360437,
+	/* -10 */ 449829, 563644, 704092, 875808, 1099582,
+	/*  -5 */ 1376151, 1717299, 2157191, 2708049, 3363325,
+	/*   0 */ 4194304, 5237764, 6557201, 8165337, 10153586,
+	/*   5 */ 12820797, 15790320, 19976592, 24970740, 31350126,
+	/*  10 */ 39045157, 49367440, 61356675, 76695844, 95443717,
+	/*  15 */ 119304647, 148102320, 186737708, 238609294, 286331153,
+};
+
+/*
+ * SCHED_EDF tasks are periodic: a job is released every period, it may
+ * run for budget, and it should be done by the deadline after its
+ * release. Then the task calls task_wait_period() for the next release.
+ * They run before all other tasks, the one with the earliest absolute
+ * deadline first, and stay on the hart they are admitted to.
+ * Admission control keeps the sum of budget / min(deadline, period) of
+ * the SCHED_EDF tasks of each hart within EDF_UTIL_MAX, in 1/1024 units.
+ * Under 1, EDF meets all deadlines, and the rest is left to the other
+ * tasks. A job using up its budget is throttled till the next release
+ * and counted as missed, so an overrun can not hurt the other tasks.
+ * The budget is enforced with mtimecmp, so CONFIG_TICKLESS is needed.
+ */
+#define EDF_UTIL_SHIFT 10
+#define EDF_UTIL_MAX ((1 << EDF_UTIL_SHIFT) * 9 / 10)
+
+/* fp_cpu of a task which has not loaded its FP registers yet */
+#define FP_CPU_NONE 0xff
+
+/* states of a task */
+#define TASK_READY	0	/* in a ready queue */
+#define TASK_RUNNING	1	/* current task of its hart */
+#define TASK_BLOCKED	2	/* waiting, in no queue */
+#define TASK_ZOMBIE	3	/* exited, waiting to be joined */
+
+struct task {
+	struct context ctx;	/* first, so the context from a trap is the task */
+	int id;
+	uint8_t priority;
+	uint8_t state;
+	uint8_t detached;
+	uint8_t cpu;		/* the hart it runs on */
+	uint8_t policy;
+	uint8_t fair_rank;	/* null path length in the fair heap */
+	struct task *next;	/* in the ready queue or _sleepers */
+	struct task *prev;	/* in the ready queue */
+	struct task *fair_left;	/* children in the fair heap */
+	struct task *fair_right;
+	uint32_t wmult;		/* of its nice level, see _nice_to_wmult */
+	uint64_t vruntime;
+	uint64_t exec_start;	/* mtime it was switched in at */
+	uint64_t dl_release;	/* mtime the current job was released at */
+	uint64_t dl_deadline;	/* absolute deadline of the current job */
+	uint32_t dl_period;	/* in mtime, as dl_budget and dl_rel_deadline */
+	uint32_t dl_budget;
+	uint32_t dl_rel_deadline;
+	uint32_t dl_budget_left;
+	uint32_t dl_util;	/* << EDF_UTIL_SHIFT */
+	uint32_t dl_misses;
+	struct task_stat stat;	/* see task_account_trap() */
+	uint8_t fp_cpu;		/* hart it last loaded its FP registers on */
+	struct fp_context fp;	/* up to date whenever it is switched out */
+	struct task *all_next;	/* in _all_tasks */
+	struct task *joiner;	/* the task waiting in task_join() for us */
+	reg_t join_status;	/* user address to store the exit status of the joined task */
+	int exit_status;
+	uint64_t wakeup;	/* mtime to wake up at, in _sleepers */
+	uint32_t stack_size;
+#ifdef CONFIG_SYSCALL
+	reg_t stack_low;	/* lowest mapped address of the stack */
+	reg_t stack_deepest;	/* lowest address used in the reclaimed pages */
+#else
+	void *stack;		/* pages of the stack */
+#endif
+};
+
+struct task_queue {
+	struct task *head;
+	struct task *tail;
+};
+
+/* task control blocks come from _task_cache */
+static struct kmem_cache *_task_cache;
+/* all tasks which are not reaped yet */
+static struct task *_all_tasks = NULL;
+static int _next_id = 1;
+
+/* sleeping tasks, sorted by wakeup time */
+static struct task *_sleepers = NULL;
+
+/*
+ * Per-hart scheduler state. A new task is given to the hart with the
+ * fewest ready tasks, and each hart picks from its own ready queues.
+ * With CONFIG_SCHED_STEAL, a hart which runs out of ready tasks takes
+ * one from the tail of the queues of a busy hart, see _steal(), and the
+ * task stays on its new hart then.
+ * Each hart has an idle task too, which runs when no task is ready. It is
+ * in no ready queue, and it is a kernel task: it runs in machine mode
+ * since wfi is not allowed in U-mode.
+ */
+struct cpu {
+	struct spinlock lock;	/* protects the ready queues */
+	struct task *current;	/* the task running now, in no ready queue */
+	struct task_queue ready[PRIO_LEVELS];
+	uint32_t ready_bitmap;
+	struct task *fair_root;	/* heap of the ready SCHED_FAIR tasks */
+	uint64_t min_vruntime;	/* never decreases, see _fair_update_min() */
+	struct task *edf_head;	/* ready SCHED_EDF tasks, by deadline */
+	uint32_t edf_util;	/* of the SCHED_EDF tasks admitted here */
+	uint32_t nr_ready;	/* tasks in the ready queues and the heap */
+	int online;
+	struct task idle;
+	uint64_t idle_mtime;	/* mtime spent waiting in wfi */
+	uint64_t idle_reported;	/* the part of idle_mtime already reported */
+	uint64_t idle_since;	/* mtime of the last report */
+	uint32_t nr_switches;
+	uint32_t nr_stolen;	/* tasks taken from other harts */
+	uint32_t nr_steal_busy;	/* steals given up since the victim was locked */
+	uint32_t nr_dl_misses;
+	uint32_t nr_dl_throttled;
+	uint32_t nr_fp_saves;
+	uint32_t nr_fp_loads;
+	struct task *fp_owner;	/* whose FP registers are in the FPU */
+	uint32_t *idle_stack;
+	struct task *trap_task;	/* the task whose trap is being handled */
+	reg_t trap_mcycle;	/* mcycle at that trap */
+	reg_t return_mcycle;	/* mcycle and minstret at the last return */
+	reg_t return_minstret;	/* to a task */
+};
+
+static struct cpu _cpus[MAXNUM_CPU];
+
+/*
+ * _sched_lock protects _sleepers and _all_tasks, and it is held while a
+ * task blocks, till it is switched out, so that nobody can wake it up
+ * before that. Each hart's ready queues have their own lock, taken
+ * after _sched_lock if both are needed. The lock of another hart's
+ * queues is only tried, never waited for, while holding our own.
+ * All locks are taken with interrupts off as everything in the kernel,
+ * and they are released right before switch_to().
+ */
+static struct spinlock _sched_lock;
+
+#ifdef CONFIG_SCHED_STEAL
+/* bit i is set while hart i runs its idle task */
+static volatile uint32_t _idle_harts = 0;
+#endif
+
+/*
+ * mstatus of a new task, MPP selects the mode it runs in after mret.
+ * Other bits are taken over from the current mstatus, but for FS which
+ * is set at every switch, see _fp_switch_in().
+ */
+static reg_t _task_mstatus(reg_t mpp, reg_t mpie)
 {
+	return (r_mstatus() & ~(MSTATUS_MPP | MSTATUS_MPIE | MSTATUS_MIE)) | mpp | mpie;
+}
+
+/*
+ * Stack painting. Every stack is filled with STACK_PAINT when it is set
+ * up: the kernel stacks of the harts in start.S, the idle and task stacks
+ * here, and the pages a user stack grows by. Stacks grow down, so the
+ * lowest word which does not hold STACK_PAINT any more is the high-water
+ * mark of the stack, which tells how far its size can be trimmed.
+ */
+static void _paint(uint32_t *p, uint32_t size)
+{
+	for (uint32_t i = 0; i < size / sizeof(uint32_t); i++) {
+		p[i] = STACK_PAINT;
+	}
+}
+
+/* bytes from p up to the first word which is not STACK_PAINT */
+static uint32_t _paint_left(const uint32_t *p, uint32_t size)
+{
+	uint32_t i = 0;
+
+	while (i < size / sizeof(uint32_t) && p[i] == STACK_PAINT) {
+		i++;
+	}
+	return i * sizeof(uint32_t);
+}
+
+static inline uint32_t *_kstack(int hart)
+{
+	return stacks + hart * (KSTACK_SIZE / sizeof(uint32_t));
+}
+
+#ifdef CONFIG_STACK_GUARD
+/*
+ * The lowest STACK_GUARD_SIZE bytes of a stack must keep their paint,
+ * otherwise the stack has overflowed, or is about to. Checked for the
+ * kernel and idle stacks of the hart and the stack of the current task
+ * whenever the kernel returns to a task, and it panics then rather than
+ * going on with whatever has been overwritten. User stacks need no check,
+ * the guard region below them faults.
+ */
+#define STACK_GUARD_SIZE 16
+
+static void _stack_check(struct cpu *c)
+{
+	int hart = c - _cpus;
+
+	if (_paint_left(_kstack(hart), STACK_GUARD_SIZE) < STACK_GUARD_SIZE) {
+		printf("hart %d: ", hart);
+		panic("kernel stack overflow");
+	}
+	if (_paint_left(c->idle_stack, STACK_GUARD_SIZE) < STACK_GUARD_SIZE) {
+		printf("hart %d: ", hart);
+		panic("idle stack overflow");
+	}
+#ifndef CONFIG_SYSCALL
+	struct task *t = c->current;
+	if (t && t != &c->idle &&
+	    _paint_left(t->stack, STACK_GUARD_SIZE) < STACK_GUARD_SIZE) {
+		printf("task %d: ", t->id);
+		panic("stack overflow");
+	}
+#endif
+}
+#endif
+
+/*
+ * The idle loop runs with interrupts masked, except for a short window
+ * after wfi. wfi wakes up on an interrupt which is pending and enabled in
+ * mie even when mstatus.MIE is clear, so the time spent waiting can be
+ * measured before the interrupt is taken.
+ * The deferred work of the page allocator is done here too, with
+ * interrupts masked, since the trap handler may allocate pages.
+ */
+static void _idle_loop(void *arg)
+{
+	struct cpu *c = &_cpus[r_tp()];
+
+	while (1) {
+		page_background();
+
+		uint64_t start = get_mtime();
+		asm volatile("wfi");
+		c->idle_mtime += get_mtime() - start;
+
+		/* take the pending interrupt */
+		w_mstatus(r_mstatus() | MSTATUS_MIE);
+		w_mstatus(r_mstatus() & ~MSTATUS_MIE);
+	}
+}
+
+static void _idle_init(int hart)
+{
+	struct task *t = &_cpus[hart].idle;
+
+	void *stack = page_alloc(1);
+	if (!stack) {
+		panic("sched_init: out of memory");
+	}
+	_paint(stack, PAGE_SIZE);
+	_cpus[hart].idle_stack = stack;
+
+	t->ctx.sp = (reg_t)stack + PAGE_SIZE;
+	t->ctx.pc = (reg_t)_idle_loop;
+	t->ctx.mstatus = _task_mstatus(MSTATUS_MPP, 0);
+	t->ctx.satp = 0;
+	t->state = TASK_RUNNING;
+	/* below all other tasks, see _enqueue() */
+	t->priority = PRIO_IDLE;
+	t->cpu = hart;
+}
+
+/*
+ * DESCRIPTION
+ * 	Percentage of time the current hart has been idle since the last
+ * 	call. The calls need not be one tick apart, e.g. with CONFIG_TICKLESS.
+ */
+int sched_idle_percent()
+{
+	struct cpu *c = &_cpus[r_tp()];
+	uint64_t now = get_mtime();
+	uint32_t idle = c->idle_mtime - c->idle_reported;
+	uint32_t elapsed = now - c->idle_since;
+
+	c->idle_reported = c->idle_mtime;
+	c->idle_since = now;
+	if (elapsed < 100) {
+		return 0;
+	}
+	return idle / (elapsed / 100);
+}
+
+void sched_stat_dump()
+{
+	printf("hart  switches  stolen  steal-busy  edf-util  dl-miss  throttled  fp-save  fp-load\n");
+	for (int i = 0; i < MAXNUM_CPU; i++) {
+		struct cpu *c = &_cpus[i];
+		if (c->online) {
+			printf("%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n",
+			       i, c->nr_switches, c->nr_stolen, c->nr_steal_busy,
+			       (c->edf_util * 100) >> EDF_UTIL_SHIFT,
+			       c->nr_dl_misses, c->nr_dl_throttled,
+			       c->nr_fp_saves, c->nr_fp_loads);
+		}
+	}
+}
+
+/*
+ * Per-task CPU accounting. trap_vector saves mcycle and minstret in the
+ * context of the task at every trap, and they are sampled again when the
+ * kernel returns to a task, from trap_handler() or by switch_to(). So
+ * - from a return to the task till its next trap counts as the task's own
+ *   cycles and instret
+ * - from its trap till the return, to it or to the next task, counts as
+ *   its trap_cycles, the kernel work done on its behalf
+ * The counters are 32-bit on RV32, the deltas are taken before they wrap
+ * twice, which is more than a tick. The idle tasks are not accounted.
+ */
+void task_account_trap(struct context *cxt)
+{
+	struct cpu *c = &_cpus[r_tp()];
+	struct task *t = c->current;
+
+	c->trap_mcycle = cxt->trap_mcycle;
+	c->trap_task = NULL;
+	if (t && t != &c->idle) {
+		t->stat.cycles += (reg_t)(cxt->trap_mcycle - c->return_mcycle);
+		t->stat.instret += (reg_t)(cxt->trap_minstret - c->return_minstret);
+		c->trap_task = t;
+	}
+}
+
+/* charge the trap being handled to its task */
+static void _account_trap_end(struct cpu *c)
+{
+	if (c->trap_task) {
+		c->trap_task->stat.trap_cycles += (reg_t)(r_mcycle() - c->trap_mcycle);
+		c->trap_task = NULL;
+	}
+}
+
+static inline void _account_return(struct cpu *c)
+{
+	c->return_mcycle = r_mcycle();
+	c->return_minstret = r_minstret();
+}
+
+/* called by trap_handler() right before it returns to the same task */
+void task_account_return()
+{
+	struct cpu *c = &_cpus[r_tp()];
+
+	_account_trap_end(c);
+#ifdef CONFIG_STACK_GUARD
+	_stack_check(c);
+#endif
+	_account_return(c);
+}
+
+/*
+ * DESCRIPTION
+ * 	Set up the scheduler of the calling hart, and put it online so that
+ * 	new tasks can be given to it.
+ */
+void sched_init_hart()
+{
+	int hart = r_tp();
+
 	w_mscratch(0);
 
-	/* enable machine-mode software interrupts. */
+	_idle_init(hart);
+	_cpus[hart].idle_since = get_mtime();
+
+	/* enable machine-mode software interrupts, used to kick a hart too */
 	w_mie(r_mie() | MIE_MSIE);
+
+	lock_acquire(&_sched_lock);
+	_cpus[hart].online = 1;
+	lock_release(&_sched_lock);
+}
+
+void sched_init()
+{
+	_task_cache = kmem_cache_create("task", sizeof(struct task));
+	if (!_task_cache) {
+		panic("sched_init: out of memory");
+	}
+
+	sched_init_hart();
+}
+
+/* number of harts which have called sched_init_hart() */
+int sched_nr_online()
+{
+	int n = 0;
+
+	lock_acquire(&_sched_lock);
+	for (int i = 0; i < MAXNUM_CPU; i++) {
+		n += _cpus[i].online;
+	}
+	lock_release(&_sched_lock);
+	return n;
+}
+
+/* tasks on a hart: the ready ones, and the running one if it is not idle */
+static inline uint32_t _load(struct cpu *c)
+{
+	struct task *cur = c->current;
+
+	return c->nr_ready + (cur && cur != &c->idle);
+}
+
+/* the online hart with the lowest load, for a new task */
+static int _pick_cpu()
+{
+	int best = r_tp();
+
+	for (int i = 0; i < MAXNUM_CPU; i++) {
+		if (_cpus[i].online && _load(&_cpus[i]) < _load(&_cpus[best])) {
+			best = i;
+		}
+	}
+	return best;
 }
 
 /*
- * implment a simple cycle FIFO schedular
+ * Merge two leftist heaps. The right spine of a leftist heap is at most
+ * log2(n + 1) long, and the recursion only walks down the right spines,
+ * so it is shallow on the small trap stack.
  */
-void schedule()
+static struct task *_fair_merge(struct task *a, struct task *b)
+{
+	if (!a) {
+		return b;
+	}
+	if (!b) {
+		return a;
+	}
+	if (b->vruntime < a->vruntime) {
+		struct task *t = a;
+		a = b;
+		b = t;
+	}
+
+	a->fair_right = _fair_merge(a->fair_right, b);
+	if (!a->fair_left || a->fair_left->fair_rank < a->fair_right->fair_rank) {
+		struct task *t = a->fair_left;
+		a->fair_left = a->fair_right;
+		a->fair_right = t;
+	}
+	a->fair_rank = (a->fair_right ? a->fair_right->fair_rank : 0) + 1;
+	return a;
+}
+
+static void _fair_insert(struct cpu *c, struct task *t)
+{
+	t->fair_left = NULL;
+	t->fair_right = NULL;
+	t->fair_rank = 1;
+	c->fair_root = _fair_merge(c->fair_root, t);
+}
+
+/* take the task with the smallest vruntime */
+static struct task *_fair_pop(struct cpu *c)
+{
+	struct task *t = c->fair_root;
+
+	c->fair_root = _fair_merge(t->fair_left, t->fair_right);
+	return t;
+}
+
+/* charge the time a SCHED_FAIR task has run since it was switched in */
+static void _fair_account(struct task *t, uint64_t now)
+{
+	uint32_t delta = now - t->exec_start;
+
+	t->vruntime += ((uint64_t)delta * t->wmult) >> 22;
+}
+
+/*
+ * min_vruntime follows the smallest vruntime of the tasks of the hart,
+ * the one running and the ones in the heap, but never goes back.
+ */
+static void _fair_update_min(struct cpu *c, struct task *cur)
+{
+	uint64_t m = ~(uint64_t)0;
+
+	if (cur->policy == SCHED_FAIR) {
+		m = cur->vruntime;
+	}
+	if (c->fair_root && c->fair_root->vruntime < m) {
+		m = c->fair_root->vruntime;
+	}
+	if (m != ~(uint64_t)0 && m > c->min_vruntime) {
+		c->min_vruntime = m;
+	}
+}
+
+/* budget / deadline << EDF_UTIL_SHIFT, without a 64-bit division */
+static uint32_t _edf_util(uint32_t budget, uint32_t deadline)
+{
+	while (budget >= (1 << (32 - EDF_UTIL_SHIFT))) {
+		budget >>= 1;
+		deadline >>= 1;
+	}
+	return (budget << EDF_UTIL_SHIFT) / deadline;
+}
+
+/* the first online hart which can take util more, -1 if none */
+static int _edf_admit(uint32_t util)
+{
+	for (int i = 0; i < MAXNUM_CPU; i++) {
+		if (_cpus[i].online && _cpus[i].edf_util + util <= EDF_UTIL_MAX) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* charge the time a SCHED_EDF task has run to the budget of its job */
+static void _edf_charge(struct task *t, uint64_t now)
+{
+	uint32_t delta = now - t->exec_start;
+
+	t->exec_start = now;
+	t->dl_budget_left -= delta < t->dl_budget_left ? delta : t->dl_budget_left;
+}
+
+/*
+ * Move a SCHED_EDF task on to its next job, with a full budget. Jobs
+ * whose deadline has passed already by now are skipped, and missed.
+ */
+static void _edf_next_job(struct cpu *c, struct task *t, uint64_t now)
+{
+	t->dl_release += t->dl_period;
+	while (t->dl_release + t->dl_rel_deadline <= now) {
+		t->dl_release += t->dl_period;
+		t->dl_misses++;
+		c->nr_dl_misses++;
+	}
+	t->dl_deadline = t->dl_release + t->dl_rel_deadline;
+	t->dl_budget_left = t->dl_budget;
+	t->exec_start = now;
+}
+
+/* if t should run before cur, which runs on the hart of t now */
+static int _preempts(struct task *t, struct task *cur)
+{
+	if (!cur) {
+		return 1;
+	}
+	if (t->policy == SCHED_EDF) {
+		return cur->policy != SCHED_EDF || t->dl_deadline < cur->dl_deadline;
+	}
+	return cur->policy != SCHED_EDF && t->priority < cur->priority;
+}
+
+static inline void _kick(int hart)
+{
+	*(uint32_t*)CLINT_MSIP(hart) = 1;
+}
+
+/*
+ * Put a task to the tail of its ready queue, on its own hart, the caller
+ * holds the lock of that hart. If it is another hart, which runs a task
+ * the new one preempts or idles in wfi, it is kicked with a software
+ * interrupt to schedule right away, instead of at its next timer tick.
+ * If the task has to wait behind others instead, an idle hart is kicked
+ * to come and steal it.
+ */
+static void _enqueue(struct task *t)
+{
+	struct cpu *c = &_cpus[t->cpu];
+
+	t->state = TASK_READY;
+	if (t->policy == SCHED_EDF) {
+		/* after the tasks with the same deadline, to keep FIFO */
+		struct task **pp = &c->edf_head;
+		while (*pp && (*pp)->dl_deadline <= t->dl_deadline) {
+			pp = &(*pp)->next;
+		}
+		t->next = *pp;
+		*pp = t;
+	} else if (t->policy == SCHED_FAIR) {
+		_fair_insert(c, t);
+	} else {
+		struct task_queue *q = &c->ready[t->priority];
+
+		t->next = NULL;
+		t->prev = q->tail;
+		if (q->tail) {
+			q->tail->next = t;
+		} else {
+			q->head = t;
+			c->ready_bitmap |= 1 << (31 - t->priority);
+		}
+		q->tail = t;
+	}
+	c->nr_ready++;
+
+	struct task *cur = c->current;
+	if (t->cpu != r_tp() && _preempts(t, cur)) {
+		_kick(t->cpu);
+		return;
+	}
+#ifdef CONFIG_SCHED_STEAL
+	uint32_t idle = _idle_harts & ~(1 << t->cpu);
+	if (idle && cur && cur != &c->idle && (t != cur || c->nr_ready > 1)) {
+		_kick(ctz32(idle));
+	}
+#endif
+}
+
+/* unlink a task from its ready queue, the caller holds the lock */
+static void _unlink(struct cpu *c, struct task *t)
+{
+	struct task_queue *q = &c->ready[t->priority];
+
+	if (t->prev) {
+		t->prev->next = t->next;
+	} else {
+		q->head = t->next;
+	}
+	if (t->next) {
+		t->next->prev = t->prev;
+	} else {
+		q->tail = t->prev;
+	}
+	if (!q->head) {
+		c->ready_bitmap &= ~(1 << (31 - t->priority));
+	}
+	c->nr_ready--;
+}
+
+/*
+ * take the SCHED_EDF task with the earliest deadline, or the first task
+ * of the highest ready level of c, or the SCHED_FAIR task with the
+ * smallest vruntime, NULL if none
+ */
+static struct task *_dequeue(struct cpu *c)
+{
+	if (c->edf_head) {
+		struct task *t = c->edf_head;
+		c->edf_head = t->next;
+		c->nr_ready--;
+		return t;
+	}
+	if (c->ready_bitmap) {
+		struct task *t = c->ready[clz32(c->ready_bitmap)].head;
+		_unlink(c, t);
+		return t;
+	}
+	if (c->fair_root) {
+		c->nr_ready--;
+		return _fair_pop(c);
+	}
+	return NULL;
+}
+
+#ifdef CONFIG_SCHED_STEAL
+/*
+ * Take a ready task from another hart for c, which has none, the caller
+ * holds the lock of c. The harts are tried one by one starting from the
+ * next one, and the victim's lock is only tried, so two harts stealing
+ * from each other can not deadlock, and a hart busy with its queues is
+ * left alone. The task at the tail of the highest ready level is taken:
+ * it is the one its hart would run last, so it has waited the least and
+ * its hart loses the least by giving it away. SCHED_EDF tasks are never
+ * taken, they are bound to the hart they are admitted to. If only
+ * SCHED_FAIR tasks are ready, the root of the heap is taken, with its
+ * vruntime moved over to be as far from our min_vruntime as it was from
+ * the victim's.
+ * Return NULL if there is nothing to steal.
+ */
+static struct task *_steal(struct cpu *c)
+{
+	int self = c - _cpus;
+
+	for (int i = 1; i < MAXNUM_CPU; i++) {
+		int hart = (self + i) % MAXNUM_CPU;
+		struct cpu *v = &_cpus[hart];
+
+		if (!v->online || !v->nr_ready) {
+			continue;
+		}
+		if (!lock_tryacquire(&v->lock)) {
+			c->nr_steal_busy++;
+			continue;
+		}
+		struct task *t;
+		if (v->ready_bitmap) {
+			t = v->ready[clz32(v->ready_bitmap)].tail;
+			_unlink(v, t);
+		} else if (v->fair_root) {
+			t = _fair_pop(v);
+			v->nr_ready--;
+			int64_t lag = (int64_t)(t->vruntime - v->min_vruntime);
+			t->vruntime = (lag < 0 && -lag > c->min_vruntime) ?
+				      0 : c->min_vruntime + lag;
+		} else {
+			lock_release(&v->lock);
+			continue;
+		}
+		lock_release(&v->lock);
+
+		t->cpu = self;
+		c->nr_stolen++;
+		return t;
+	}
+	return NULL;
+}
+#endif
+
+static struct task *_find(int id)
+{
+	for (struct task *t = _all_tasks; t; t = t->all_next) {
+		if (t->id == id) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Free everything of a task. Its address space may still be in satp,
+ * that is fine since the kernel is not translated and switch_to() loads
+ * the satp of the next task before it returns to U-mode.
+ */
+static void _task_free(struct task *t)
+{
+	/*
+	 * A new task at the same address must not take over its FP
+	 * registers, on any hart it has loaded them on.
+	 */
+	for (int i = 0; i < MAXNUM_CPU; i++) {
+		if (_cpus[i].fp_owner == t) {
+			_cpus[i].fp_owner = NULL;
+		}
+	}
+
+	vm_destroy(SATP_PGTBL(t->ctx.satp));
+#ifndef CONFIG_SYSCALL
+	page_free(t->stack);
+#endif
+	kmem_cache_free(_task_cache, t);
+}
+
+/* forget a task which has exited, and free it */
+static void _reap(struct task *t)
+{
+	struct task **pp = &_all_tasks;
+	while (*pp != t) {
+		pp = &(*pp)->all_next;
+	}
+	*pp = t->all_next;
+
+	if (t->policy == SCHED_EDF) {
+		_cpus[t->cpu].edf_util -= t->dl_util;
+	}
+	_task_free(t);
+}
+
+#ifdef CONFIG_SYSCALL
+static inline reg_t _page_round_down(reg_t a)
+{
+	return a & ~(PAGE_SIZE - 1);
+}
+
+static void _ustack_paint(pte_t *pgtbl, reg_t low, reg_t high)
+{
+	for (reg_t va = low; va < high; va += PAGE_SIZE) {
+		_paint((uint32_t *)vm_translate(pgtbl, va), PAGE_SIZE);
+	}
+}
+
+/*
+ * lowest address in the user stack pages [low, high) which is used, or
+ * high. Pages which are not mapped are skipped: another hart may be
+ * unmapping them in _stack_reclaim() before it moves stack_low up.
+ */
+static reg_t _ustack_deepest(pte_t *pgtbl, reg_t low, reg_t high)
 {
-	if (_top <= 0) {
-		panic("Num of task should be greater than zero!");
+	for (reg_t va = low; va < high; va += PAGE_SIZE) {
+		uint32_t *p = (uint32_t *)vm_translate(pgtbl, va);
+		if (!p) {
+			continue;
+		}
+		uint32_t n = _paint_left(p, PAGE_SIZE);
+		if (n < PAGE_SIZE) {
+			return va + n;
+		}
+	}
+	return high;
+}
+
+/*
+ * unmap the stack pages of a task which are well below its sp, what has
+ * been used of them is kept in stack_deepest
+ */
+static void _stack_reclaim(struct task *t)
+{
+	struct context *cxt = &t->ctx;
+	reg_t keep = _page_round_down(cxt->sp) - USTACK_SLACK_PAGES * PAGE_SIZE;
+
+	if (t->stack_low < keep) {
+		reg_t deepest = _ustack_deepest(SATP_PGTBL(cxt->satp), t->stack_low, keep);
+		if (deepest < t->stack_deepest) {
+			t->stack_deepest = deepest;
+		}
+		vm_unmap(SATP_PGTBL(cxt->satp), t->stack_low, keep - t->stack_low);
+		t->stack_low = keep;
+	}
+}
+
+/*
+ * DESCRIPTION
+ * 	Grow the stack of the current task to cover addr, called on a page
+ * 	fault at addr. The fault is a stack access only if addr is inside
+ * 	the stack region and not below the sp of the task, since the ABI
+ * 	keeps no data below sp.
+ * RETURN VALUE
+ * 	0: success, the faulting instruction can be retried
+ * 	-1: if it is not a stack fault, or out of memory
+ */
+int task_stack_grow(struct context *cxt, reg_t addr)
+{
+	struct task *t = _cpus[r_tp()].current;
+
+	if (addr < USTACK_TOP - t->stack_size || addr >= t->stack_low || addr < cxt->sp) {
+		return -1;
+	}
+
+	reg_t low = _page_round_down(addr);
+	if (vm_alloc(SATP_PGTBL(cxt->satp), low, t->stack_low - low,
+		     PTE_R | PTE_W | PTE_U) < 0) {
+		return -1;
+	}
+	_ustack_paint(SATP_PGTBL(cxt->satp), low, t->stack_low);
+	t->stack_low = low;
+	return 0;
+}
+#endif
+
+/* high-water mark of the stack of a task, in bytes */
+static uint32_t _stack_used(struct task *t)
+{
+#ifdef CONFIG_SYSCALL
+	/*
+	 * t may run on another hart meanwhile. A page it reclaims is put in
+	 * stack_deepest before it is unmapped, and skipped once it is, at
+	 * worst it is read while being freed, which only blurs the mark.
+	 */
+	reg_t deepest = _ustack_deepest(SATP_PGTBL(t->ctx.satp), t->stack_low, USTACK_TOP);
+	if (deepest > t->stack_deepest) {
+		deepest = t->stack_deepest;
+	}
+	return USTACK_TOP - deepest;
+#else
+	return t->stack_size - _paint_left(t->stack, t->stack_size);
+#endif
+}
+
+/*
+ * Lazy FP context. The F/D registers of a task are saved only if it has
+ * written them, and loaded only when it uses them after a switch:
+ * - a task is switched in with mstatus.FS Off, so its first FP
+ *   instruction traps as illegal, and task_fp_trap() loads its registers
+ *   and sets FS Clean. If the FPU of the hart still holds them, since no
+ *   other task has loaded its own since, FS is Clean right away.
+ * - an FP write sets FS Dirty, and a Dirty task has its registers saved
+ *   when it is switched out.
+ * So a task which never uses FP never has them saved or loaded, and the
+ * saved registers are up to date whenever a task is not running, so it
+ * can move to another hart.
+ */
+static inline void _set_fs(reg_t *mstatus, reg_t fs)
+{
+	*mstatus = (*mstatus & ~MSTATUS_FS) | fs;
+}
+
+static void _fp_switch_out(struct cpu *c, struct task *t)
+{
+	if ((t->ctx.mstatus & MSTATUS_FS) != MSTATUS_FS_DIRTY) {
 		return;
 	}
+	/* FS of the trapped task is still in mstatus, so it is Dirty */
+	fp_save(&t->fp);
+	_set_fs(&t->ctx.mstatus, MSTATUS_FS_CLEAN);
+	c->nr_fp_saves++;
+}
 
-	_current = (_current + 1) % _top;
-	struct context *next = &(ctx_tasks[_current]);
-	switch_to(next);
+static void _fp_switch_in(struct cpu *c, struct task *t)
+{
+	if (c->fp_owner == t && t->fp_cpu == c - _cpus) {
+		_set_fs(&t->ctx.mstatus, MSTATUS_FS_CLEAN);
+	} else {
+		_set_fs(&t->ctx.mstatus, MSTATUS_FS_OFF);
+	}
+}
+
+/*
+ * DESCRIPTION
+ * 	Called on an illegal instruction trap, which may be the first FP
+ * 	instruction of the current task since it was switched in. Its FP
+ * 	registers are loaded then, and the instruction can be retried.
+ * RETURN VALUE
+ * 	0: the registers are loaded
+ * 	-1: FP was on already, so the instruction is illegal indeed
+ */
+int task_fp_trap(struct context *cxt)
+{
+	struct cpu *c = &_cpus[r_tp()];
+	struct task *t = c->current;
+
+	if (!t || t == &c->idle || (cxt->mstatus & MSTATUS_FS) != MSTATUS_FS_OFF) {
+		return -1;
+	}
+
+	/* mret of the trap returns with FS of mstatus, not of the context */
+	reg_t mstatus = r_mstatus();
+	_set_fs(&mstatus, MSTATUS_FS_INITIAL);
+	w_mstatus(mstatus);
+	fp_restore(&t->fp);
+	_set_fs(&mstatus, MSTATUS_FS_CLEAN);
+	w_mstatus(mstatus);
+	_set_fs(&cxt->mstatus, MSTATUS_FS_CLEAN);
+
+	c->fp_owner = t;
+	t->fp_cpu = c - _cpus;
+	c->nr_fp_loads++;
+	return 0;
+}
+
+/*
+ * Put the current task back to the tail of its ready queue if it is
+ * still running, and switch to the first task of the highest ready level
+ * of this hart, or a task stolen from another hart, or the idle task if
+ * no task is ready. It takes constant time, but for stealing.
+ * The caller holds the lock of c, and the lock held if it is not NULL,
+ * both are released here. voluntary is set if the current task gives up
+ * the CPU by itself, then it is not counted as preempted.
+ */
+static void _schedule_locked(struct cpu *c, struct spinlock *held, int voluntary)
+{
+	struct task *prev = c->current;
+	uint64_t now = get_mtime();
+	int preempted = 0;
+
+	if (prev && prev != &c->idle) {
+		if (prev->policy == SCHED_FAIR) {
+			_fair_account(prev, now);
+		} else if (prev->policy == SCHED_EDF) {
+			_edf_charge(prev, now);
+		}
+#ifdef CONFIG_SYSCALL
+		_stack_reclaim(prev);
+#endif
+		_fp_switch_out(c, prev);
+		preempted = !voluntary;
+		if (prev->state == TASK_RUNNING) {
+			_enqueue(prev);
+		}
+	}
+
+	struct task *next = _dequeue(c);
+#ifdef CONFIG_SCHED_STEAL
+	if (!next) {
+		next = _steal(c);
+	}
+#endif
+	if (!next) {
+		next = &c->idle;
+	}
+
+#ifdef CONFIG_SCHED_STEAL
+	uint32_t bit = 1 << (c - _cpus);
+	if (next == &c->idle) {
+		__sync_fetch_and_or(&_idle_harts, bit);
+	} else {
+		__sync_fetch_and_and(&_idle_harts, ~bit);
+	}
+#endif
+
+	if (next != prev) {
+		c->nr_switches++;
+		if (prev && prev != &c->idle) {
+			if (preempted) {
+				prev->stat.nr_preempted++;
+			} else {
+				prev->stat.nr_voluntary++;
+			}
+		}
+	}
+	next->state = TASK_RUNNING;
+	next->exec_start = now;
+	_fp_switch_in(c, next);
+	_fair_update_min(c, next);
+	c->current = next;
+	/* prev can be stolen or woken up once the locks are released */
+	_account_trap_end(c);
+	lock_release(&c->lock);
+	if (held) {
+		lock_release(held);
+	}
+#ifdef CONFIG_TICKLESS
+	uint32_t slice = TIMER_NO_SLICE;
+	if (next->policy == SCHED_EDF) {
+		slice = next->dl_budget_left;
+	} else if (next != &c->idle) {
+		slice = TIME_SLICE;
+	}
+	timer_reprogram(slice);
+#endif
+#ifdef CONFIG_STACK_GUARD
+	_stack_check(c);
+#endif
+	_account_return(c);
+	switch_to(&next->ctx);
+}
+
+/*
+ * switch out the current task, which has blocked under _sched_lock,
+ * voluntary as in _schedule_locked()
+ */
+static void _block(int voluntary)
+{
+	struct cpu *c = &_cpus[r_tp()];
+
+	lock_acquire(&c->lock);
+	_schedule_locked(c, &_sched_lock, voluntary);
+}
+
+/* insert t to _sleepers, the caller holds _sched_lock */
+static void _sleep_insert(struct task *t, uint64_t mtime)
+{
+	/* insert after the tasks with the same wakeup time, to keep FIFO */
+	struct task **pp = &_sleepers;
+	while (*pp && (*pp)->wakeup <= mtime) {
+		pp = &(*pp)->next;
+	}
+	t->next = *pp;
+	*pp = t;
+
+	t->wakeup = mtime;
+	t->state = TASK_BLOCKED;
+}
+
+/*
+ * A SCHED_EDF task which has used up the budget of its job is throttled
+ * here: it sleeps till its next release, and the job is missed. It does
+ * not return then. Called before every switch the task does not block
+ * for, with no lock held, since _sleepers takes _sched_lock first.
+ * A task whose budget runs out in the short window after this check is
+ * switched in again with no budget left, and timer_reprogram() fires
+ * right away for it, so it ends up here again.
+ */
+static void _edf_throttle(struct cpu *c)
+{
+	struct task *cur = c->current;
+
+	if (cur && cur->policy == SCHED_EDF && cur->state == TASK_RUNNING) {
+		uint64_t now = get_mtime();
+		_edf_charge(cur, now);
+		if (!cur->dl_budget_left) {
+			c->nr_dl_throttled++;
+			cur->dl_misses++;
+			c->nr_dl_misses++;
+			_edf_next_job(c, cur, now);
+			if (cur->dl_release > now) {
+				lock_acquire(&_sched_lock);
+				_sleep_insert(cur, cur->dl_release);
+				_block(0);
+			}
+		}
+	}
+}
+
+void schedule()
+{
+	struct cpu *c = &_cpus[r_tp()];
+
+	_edf_throttle(c);
+	lock_acquire(&c->lock);
+	_schedule_locked(c, NULL, 0);
+}
+
+/*
+ * make a blocked or new task ready again, on its hart. A SCHED_FAIR task
+ * gets at most FAIR_WAKEUP_CREDIT of vruntime below min_vruntime.
+ */
+static void _wake(struct task *t)
+{
+	struct cpu *c = &_cpus[t->cpu];
+
+	lock_acquire(&c->lock);
+	if (t->policy == SCHED_FAIR) {
+		uint64_t floor = c->min_vruntime > FAIR_WAKEUP_CREDIT ?
+				 c->min_vruntime - FAIR_WAKEUP_CREDIT : 0;
+		if (t->vruntime < floor) {
+			t->vruntime = floor;
+		}
+	}
+	_enqueue(t);
+	lock_release(&c->lock);
 }
 
 /*
  * DESCRIPTION
  * 	Create a task.
- * 	- start_routin: task routine entry
+ * 	- start_routin: task routine entry, it is called with attr->arg and
+ * 	  the task exits with status 0 when it returns.
+ * 	- attr: attributes of the task, NULL for the defaults:
+ * 	  arg: NULL
+ * 	  stack_size: 0 for STACK_SIZE_DEFAULT, up to STACK_SIZE_MAX
+ * 	  priority: 0 ~ (PRIO_LEVELS - 1), 0 is the highest priority,
+ * 	  for SCHED_PRIO only
+ * 	  detached: if set, the task is reaped when it exits and can not be
+ * 	  joined
+ * 	  policy: SCHED_PRIO, or SCHED_FAIR to share the CPU by weight with
+ * 	  the other SCHED_FAIR tasks, when no SCHED_PRIO task is ready
+ * 	  nice: NICE_MIN ~ NICE_MAX, the lower the more CPU a SCHED_FAIR
+ * 	  task gets
+ * 	  period, budget, deadline: of a SCHED_EDF task, which runs before
+ * 	  all others, in us, budget <= deadline <= period. Its first job
+ * 	  is released right away. It is not admitted if no hart has the
+ * 	  capacity for it, see EDF_UTIL_MAX.
  * RETURN VALUE
- * 	0: success
+ * 	id of the task, which is greater than 0
  * 	-1: if error occured
  */
-int task_create(void (*start_routin)(void))
+int task_create(void (*start_routin)(void *arg), const struct task_attr *attr)
 {
-	if (_top < MAX_TASKS) {
-		ctx_tasks[_top].sp = (reg_t) &task_stack[_top][STACK_SIZE];
-		ctx_tasks[_top].pc = (reg_t) start_routin;
-		_top++;
-		return 0;
+	struct task_attr defaults = { .priority = PRIO_DEFAULT };
+	if (!attr) {
+		attr = &defaults;
+	}
+
+	uint32_t stack_size = attr->stack_size ? attr->stack_size : STACK_SIZE_DEFAULT;
+	stack_size = (stack_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (attr->priority >= PRIO_LEVELS || stack_size > STACK_SIZE_MAX) {
+		return -1;
+	}
+	if (attr->policy > SCHED_EDF || attr->nice < NICE_MIN || attr->nice > NICE_MAX) {
+		return -1;
+	}
+
+	/* in 64-bit, a period of more than ~429s does not fit mtime in 32 */
+	uint64_t period = US_TO_MTIME((uint64_t)attr->period);
+	uint64_t budget = US_TO_MTIME((uint64_t)attr->budget);
+	uint64_t deadline = attr->deadline ? US_TO_MTIME((uint64_t)attr->deadline) : period;
+	if (attr->policy == SCHED_EDF) {
+#ifndef CONFIG_TICKLESS
+		return -1;
+#endif
+		if (!budget || budget > deadline || deadline > period
+		    || period > 0xffffffff) {
+			return -1;
+		}
+	}
+
+	struct task *t = kmem_cache_alloc(_task_cache);
+	if (!t) {
+		return -1;
+	}
+	for (int i = 0; i < sizeof(struct task) / sizeof(reg_t); i++) {
+		((reg_t *)t)[i] = 0;
+	}
+	t->fp_cpu = FP_CPU_NONE;
+
+	pte_t *pgtbl = vm_create();
+	if (!pgtbl) {
+		kmem_cache_free(_task_cache, t);
+		return -1;
+	}
+#ifdef CONFIG_SYSCALL
+	t->stack_low = USTACK_TOP - PAGE_SIZE;
+	if (vm_alloc(pgtbl, t->stack_low, PAGE_SIZE, PTE_R | PTE_W | PTE_U) < 0) {
+		vm_destroy(pgtbl);
+		kmem_cache_free(_task_cache, t);
+		return -1;
+	}
+	_ustack_paint(pgtbl, t->stack_low, USTACK_TOP);
+	t->stack_deepest = USTACK_TOP;
+	t->ctx.sp = USTACK_TOP;
+#else
+	/* tasks run in machine mode and see physical addresses */
+	t->stack = page_alloc(stack_size / PAGE_SIZE);
+	if (!t->stack) {
+		vm_destroy(pgtbl);
+		kmem_cache_free(_task_cache, t);
+		return -1;
+	}
+	_paint(t->stack, stack_size);
+	t->ctx.sp = (reg_t)t->stack + stack_size;
+#endif
+	t->ctx.pc = (reg_t)start_routin;
+	t->ctx.ra = (reg_t)task_return;
+	t->ctx.a0 = (reg_t)attr->arg;
+	t->ctx.satp = MAKE_SATP(pgtbl);
+#ifdef CONFIG_SYSCALL
+	t->ctx.mstatus = _task_mstatus(0, MSTATUS_MPIE);
+#else
+	t->ctx.mstatus = _task_mstatus(MSTATUS_MPP, MSTATUS_MPIE);
+#endif
+	t->stack_size = stack_size;
+	t->stat.stack_size = stack_size;
+	t->policy = attr->policy;
+	t->priority = attr->policy == SCHED_FAIR ? PRIO_FAIR : attr->priority;
+	t->wmult = _nice_to_wmult[attr->nice - NICE_MIN];
+	t->detached = attr->detached;
+
+	lock_acquire(&_sched_lock);
+	if (t->policy == SCHED_EDF) {
+		t->priority = 0;
+		t->dl_period = period;
+		t->dl_budget = budget;
+		t->dl_rel_deadline = deadline;
+		t->dl_util = _edf_util(budget, deadline);
+		int cpu = _edf_admit(t->dl_util);
+		if (cpu < 0) {
+			lock_release(&_sched_lock);
+			_task_free(t);
+			return -1;
+		}
+		_cpus[cpu].edf_util += t->dl_util;
+		t->cpu = cpu;
+		t->dl_release = get_mtime();
+		t->dl_deadline = t->dl_release + deadline;
+		t->dl_budget_left = budget;
 	} else {
+		t->cpu = _pick_cpu();
+	}
+	int id = t->id = _next_id++;
+	t->all_next = _all_tasks;
+	_all_tasks = t;
+	_wake(t);
+	lock_release(&_sched_lock);
+
+	return id;
+}
+
+/*
+ * DESCRIPTION
+ * 	Exit the current task with status, called by the task_exit syscall.
+ * 	A task waiting in task_join() for it is woken up, a detached task is
+ * 	reaped right away, otherwise it stays a zombie till it is joined.
+ * 	It does not return.
+ */
+void sys_task_exit(int status)
+{
+	struct cpu *c = &_cpus[r_tp()];
+
+	lock_acquire(&_sched_lock);
+
+	struct task *t = c->current;
+	struct task *j = t->joiner;
+
+	t->exit_status = status;
+	c->current = NULL;
+	/* t may be reaped before the trap ends */
+	c->trap_task = NULL;
+
+	if (j) {
+		if (j->join_status) {
+			copyout(SATP_PGTBL(j->ctx.satp), j->join_status, &status, sizeof(status));
+		}
+		j->ctx.a0 = t->id;
+		_wake(j);
+		_reap(t);
+	} else if (t->detached) {
+		_reap(t);
+	} else {
+		t->state = TASK_ZOMBIE;
+	}
+
+	_block(1);
+}
+
+/*
+ * DESCRIPTION
+ * 	Wait for the task id to exit and reap it, called by the task_join
+ * 	syscall. If the task is still alive, the caller blocks, and its
+ * 	return value is filled in by sys_task_exit() then.
+ * 	- status: user address to store the exit status, or 0
+ * RETURN VALUE
+ * 	id of the joined task
+ * 	-1: if there is no such task, it is the caller itself, it is detached
+ * 	    or somebody is joining it already.
+ */
+int sys_task_join(int id, reg_t status)
+{
+	struct task *self = _cpus[r_tp()].current;
+
+	lock_acquire(&_sched_lock);
+
+	struct task *t = _find(id);
+	if (!t || t == self || t->detached || t->joiner) {
+		lock_release(&_sched_lock);
 		return -1;
 	}
+
+	if (t->state == TASK_ZOMBIE) {
+		if (status) {
+			copyout(SATP_PGTBL(self->ctx.satp), status,
+				&t->exit_status, sizeof(t->exit_status));
+		}
+		_reap(t);
+		lock_release(&_sched_lock);
+		return id;
+	}
+
+	t->joiner = self;
+	self->join_status = status;
+	self->state = TASK_BLOCKED;
+	_block(1);
+
+	return -1; /* never here */
+}
+
+/*
+ * DESCRIPTION
+ * 	Block the current task till mtime reaches the given value, called
+ * 	by the task_sleep_until syscall. The task is woken up by the first
+ * 	timer interrupt at or after that time, which is the time itself with
+ * 	CONFIG_TICKLESS.
+ * RETURN VALUE
+ * 	0
+ */
+int sys_task_sleep_until(uint64_t mtime)
+{
+	struct task *t = _cpus[r_tp()].current;
+
+	if (mtime <= get_mtime()) {
+		return 0;
+	}
+
+	lock_acquire(&_sched_lock);
+	_sleep_insert(t, mtime);
+	t->ctx.a0 = 0;
+	_block(1);
+
+	return 0; /* never here */
+}
+
+/*
+ * DESCRIPTION
+ * 	End the current job of a SCHED_EDF task, and wait for the release
+ * 	of the next one, called by the task_wait_period syscall. The job is
+ * 	missed if its deadline has passed.
+ * RETURN VALUE
+ * 	number of jobs the task has missed so far
+ * 	-1: if the caller is not a SCHED_EDF task
+ */
+int sys_task_wait_period()
+{
+	struct cpu *c = &_cpus[r_tp()];
+	struct task *t = c->current;
+	uint64_t now = get_mtime();
+
+	if (t->policy != SCHED_EDF) {
+		return -1;
+	}
+
+	if (now > t->dl_deadline) {
+		t->dl_misses++;
+		c->nr_dl_misses++;
+	}
+	_edf_next_job(c, t, now);
+	if (t->dl_release <= now) {
+		return t->dl_misses;
+	}
+
+	lock_acquire(&_sched_lock);
+	_sleep_insert(t, t->dl_release);
+	t->ctx.a0 = t->dl_misses;
+	_block(1);
+
+	return -1; /* never here */
+}
+
+/*
+ * DESCRIPTION
+ * 	Block the current task for at least ticks * TIMER_INTERVAL of mtime,
+ * 	called by the task_sleep syscall.
+ * RETURN VALUE
+ * 	0
+ */
+int sys_task_sleep(uint32_t ticks)
+{
+	if (ticks == 0) {
+		return 0;
+	}
+	return sys_task_sleep_until(get_mtime() + (uint64_t)ticks * TIMER_INTERVAL);
+}
+
+/* mtime of the first sleeper to wake up, or ~0 if none */
+uint64_t task_next_wakeup()
+{
+	uint64_t t = ~(uint64_t)0;
+
+	lock_acquire(&_sched_lock);
+	if (_sleepers) {
+		t = _sleepers->wakeup;
+	}
+	lock_release(&_sched_lock);
+	return t;
+}
+
+/*
+ * Move the sleeping tasks whose time has come to the ready queues of
+ * their harts, called by the timer handler of each hart.
+ */
+void task_wake_sleepers(uint64_t now)
+{
+	lock_acquire(&_sched_lock);
+	while (_sleepers && _sleepers->wakeup <= now) {
+		struct task *t = _sleepers;
+		_sleepers = t->next;
+		_wake(t);
+	}
+	lock_release(&_sched_lock);
+}
+
+/*
+ * DESCRIPTION
+ * 	Print the CPU usage of all tasks, cycles and instructions in 1024s,
+ * 	and the size and high-water mark of their stacks in bytes.
+ * 	The stats are copied under _sched_lock and printed after, so that
+ * 	the other harts do not wait for the UART. Only the first
+ * 	TASK_DUMP_MAX tasks are printed, and how many more there are.
+ */
+#define TASK_DUMP_MAX 32
+
+struct task_dump {
+	int id;
+	uint8_t cpu;
+	uint8_t state;
+	uint32_t kcycles;
+	uint32_t kinstret;
+	uint32_t trap_kcycles;
+	uint32_t nr_voluntary;
+	uint32_t nr_preempted;
+	uint32_t stack_size;
+	uint32_t stack_used;
+};
+
+static struct task_dump _dump[TASK_DUMP_MAX];
+static struct spinlock _dump_lock;
+
+void sched_task_dump()
+{
+	static const char *states[] = { "ready", "run", "blocked", "zombie" };
+	int n = 0;
+	int more = 0;
+
+	lock_acquire(&_dump_lock);
+	lock_acquire(&_sched_lock);
+	for (struct task *t = _all_tasks; t; t = t->all_next) {
+		if (n == TASK_DUMP_MAX) {
+			more++;
+			continue;
+		}
+		struct task_dump *d = &_dump[n++];
+		d->id = t->id;
+		d->cpu = t->cpu;
+		d->state = t->state;
+		d->kcycles = t->stat.cycles >> 10;
+		d->kinstret = t->stat.instret >> 10;
+		d->trap_kcycles = t->stat.trap_cycles >> 10;
+		d->nr_voluntary = t->stat.nr_voluntary;
+		d->nr_preempted = t->stat.nr_preempted;
+		d->stack_size = t->stack_size;
+		d->stack_used = _stack_used(t);
+	}
+	lock_release(&_sched_lock);
+
+	printf("task  hart  state  kcycles  kinstret  trap-kcycles  voluntary  preempted  stack  used\n");
+	for (int i = 0; i < n; i++) {
+		struct task_dump *d = &_dump[i];
+		printf("%d\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n",
+		       d->id, d->cpu, states[d->state], d->kcycles, d->kinstret,
+		       d->trap_kcycles, d->nr_voluntary, d->nr_preempted,
+		       d->stack_size, d->stack_used);
+	}
+	if (more) {
+		printf("... %d more\n", more);
+	}
+	lock_release(&_dump_lock);
+}
+
+/*
+ * DESCRIPTION
+ * 	Print the high-water marks of the kernel and idle stacks of each
+ * 	hart, and of all tasks. Typed 's' on the console calls it.
+ */
+void sched_stack_dump()
+{
+	printf("hart  kstack  used  idle-stack  used\n");
+	for (int i = 0; i < MAXNUM_CPU; i++) {
+		struct cpu *c = &_cpus[i];
+		if (c->online) {
+			printf("%d\t%d\t%d\t%d\t%d\n", i,
+			       KSTACK_SIZE, KSTACK_SIZE - _paint_left(_kstack(i), KSTACK_SIZE),
+			       PAGE_SIZE, PAGE_SIZE - _paint_left(c->idle_stack, PAGE_SIZE));
+		}
+	}
+	sched_task_dump();
+}
+
+/*
+ * DESCRIPTION
+ * 	Get the CPU usage of a task, called by the task_stat syscall.
+ * 	- id: the task, 0 for the caller itself
+ * 	- stat: user address of a struct task_stat to fill in
+ * RETURN VALUE
+ * 	0: success
+ * 	-1: if there is no such task, or stat is not writable
+ */
+int sys_task_stat(int id, reg_t stat)
+{
+	struct task *self = _cpus[r_tp()].current;
+	int ret = -1;
+
+	lock_acquire(&_sched_lock);
+	struct task *t = id ? _find(id) : self;
+	if (t) {
+		t->stat.stack_used = _stack_used(t);
+		ret = copyout(SATP_PGTBL(self->ctx.satp), stat, &t->stat, sizeof(t->stat));
+	}
+	lock_release(&_sched_lock);
+
+	return ret;
 }
 
 /*
  * DESCRIPTION
  * 	task_yield()  causes the calling task to relinquish the CPU and a new 
  * 	task gets to run.
+ * 	With CONFIG_SYSCALL the tasks run in U-mode, where CLINT is not
+ * 	writable, so it takes the sched_yield syscall. Otherwise it raises a
+ * 	software interrupt to get to the scheduler.
  */
 void task_yield()
 {
+#ifdef CONFIG_SYSCALL
+	sched_yield();
+#else
 	/* trigger a machine-level software interrupt */
-	int id = r_mhartid();
+	int id = r_tp();
 	*(uint32_t*)CLINT_MSIP(id) = 1;
+#endif
+}
+
+/*
+ * DESCRIPTION
+ * 	Called by the sched_yield syscall, trap_handler() takes it before any
+ * 	other syscall. The caller goes to the tail of its ready queue and the
+ * 	next task is switched to right away, with no software interrupt to
+ * 	raise and take. The switch counts as voluntary.
+ * 	It does not return, the caller resumes from its context.
+ */
+void sys_sched_yield()
+{
+	struct cpu *c = &_cpus[r_tp()];
+
+	_edf_throttle(c);
+	lock_acquire(&c->lock);
+	_schedule_locked(c, NULL, 1);
 }
 
 /*
@@ -82,4 +1649,3 @@ void task_delay(volatile int count)
 	count *= 50000;
 	while (count--);
 }
-
@@ -0,0 +1,313 @@
+#include "os.h"
+
+/*
+ * Slab allocator for small kernel objects, layered on page_alloc().
+ *
+ * A cache hands out objects of one fixed size. Its memory comes in slabs
+ * of one page each: the struct slab header sits at the beginning of the
+ * page and the rest of the page is cut into objects. Free objects of a
+ * slab are chained through their first word, so allocating or freeing an
+ * object takes a few pointer operations and never looks at the page
+ * descriptors. The slab an object belongs to is found by rounding the
+ * object address down to the page boundary.
+ *
+ * kmalloc()/kfree() sit on top of a set of caches with power-of-2 object
+ * sizes from 16 to 1024 bytes, bigger requests go to page_alloc(). There
+ * is no 2048 byte class: with the header in the page only one such object
+ * fits in a slab, which would waste almost half of every page.
+ *
+ * Each cache has its own lock, since tasks on all harts allocate from the
+ * same caches, and _caches_lock protects the list of caches.
+ */
+
+#define SLAB_ALIGN 8
+
+#define KMALLOC_MIN_ORDER 4	/* 16 bytes */
+#define KMALLOC_MAX_ORDER 10	/* 1024 bytes */
+
+struct slab {
+	struct kmem_cache *cache;
+	struct slab *next;
+	struct slab *prev;
+	void *freelist;
+	uint32_t inuse;
+};
+
+struct kmem_cache {
+	const char *name;
+	uint32_t size;		/* object size, aligned to SLAB_ALIGN */
+	uint32_t num;		/* number of objects per slab */
+	struct slab *partial;	/* slabs with at least one free object */
+	struct slab *full;	/* slabs with no free object */
+	uint32_t nr_slabs;
+	uint32_t nr_objs;	/* number of objects in use */
+	struct spinlock lock;
+	struct kmem_cache *next;
+};
+
+/* cache of the struct kmem_cache descriptors themselves */
+static struct kmem_cache _cache_cache;
+/* all caches, linked by kmem_cache.next */
+static struct kmem_cache *_caches = NULL;
+static struct spinlock _caches_lock;
+
+static struct kmem_cache *_kmalloc_caches[KMALLOC_MAX_ORDER - KMALLOC_MIN_ORDER + 1];
+static const char *_kmalloc_names[KMALLOC_MAX_ORDER - KMALLOC_MIN_ORDER + 1] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+static inline uint32_t _align(uint32_t size, uint32_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+/* objects start right after the slab header */
+#define SLAB_OBJ_OFFSET _align(sizeof(struct slab), SLAB_ALIGN)
+
+static inline struct slab *_slab_of(void *obj)
+{
+	return (struct slab *)((ptr_t)obj & ~(PAGE_SIZE - 1));
+}
+
+static inline void _list_add(struct slab **head, struct slab *s)
+{
+	s->prev = NULL;
+	s->next = *head;
+	if (*head) {
+		(*head)->prev = s;
+	}
+	*head = s;
+}
+
+static inline void _list_del(struct slab **head, struct slab *s)
+{
+	if (s->prev) {
+		s->prev->next = s->next;
+	} else {
+		*head = s->next;
+	}
+	if (s->next) {
+		s->next->prev = s->prev;
+	}
+}
+
+static struct slab *_slab_new(struct kmem_cache *cache)
+{
+	struct slab *s = (struct slab *)page_alloc(1);
+	if (!s) {
+		return NULL;
+	}
+
+	s->cache = cache;
+	s->inuse = 0;
+	s->freelist = NULL;
+
+	/* chain the objects, the first object ends up at the list head */
+	uint8_t *obj = (uint8_t *)s + SLAB_OBJ_OFFSET + (cache->num - 1) * cache->size;
+	for (int i = 0; i < cache->num; i++) {
+		*(void **)obj = s->freelist;
+		s->freelist = obj;
+		obj -= cache->size;
+	}
+
+	_list_add(&cache->partial, s);
+	cache->nr_slabs++;
+	return s;
+}
+
+static void _cache_setup(struct kmem_cache *cache, const char *name, uint32_t size)
+{
+	cache->name = name;
+	cache->size = size;
+	cache->num = (PAGE_SIZE - SLAB_OBJ_OFFSET) / size;
+	cache->partial = NULL;
+	cache->full = NULL;
+	cache->nr_slabs = 0;
+	cache->nr_objs = 0;
+	lock_init(&cache->lock);
+
+	lock_acquire(&_caches_lock);
+	cache->next = _caches;
+	_caches = cache;
+	lock_release(&_caches_lock);
+}
+
+/*
+ * DESCRIPTION
+ * 	Create a cache of objects.
+ * 	- name: name of the cache, the string is not copied.
+ * 	- size: size of each object in bytes.
+ * RETURN VALUE
+ * 	the cache, or NULL if size is invalid or out of memory.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size)
+{
+	size = _align(size ? size : 1, SLAB_ALIGN);
+	if (size > PAGE_SIZE - SLAB_OBJ_OFFSET) {
+		return NULL;
+	}
+
+	struct kmem_cache *cache = kmem_cache_alloc(&_cache_cache);
+	if (!cache) {
+		return NULL;
+	}
+	_cache_setup(cache, name, size);
+	return cache;
+}
+
+/*
+ * DESCRIPTION
+ * 	Destroy a cache and give its slabs back to the page allocator.
+ * RETURN VALUE
+ * 	0: success
+ * 	-1: if objects of the cache are still in use
+ */
+int kmem_cache_destroy(struct kmem_cache *cache)
+{
+	lock_acquire(&cache->lock);
+	if (cache->nr_objs) {
+		lock_release(&cache->lock);
+		return -1;
+	}
+
+	while (cache->partial) {
+		struct slab *s = cache->partial;
+		_list_del(&cache->partial, s);
+		page_free(s);
+	}
+	lock_release(&cache->lock);
+
+	lock_acquire(&_caches_lock);
+	struct kmem_cache **pp = &_caches;
+	while (*pp != cache) {
+		pp = &(*pp)->next;
+	}
+	*pp = cache->next;
+	lock_release(&_caches_lock);
+
+	kmem_cache_free(&_cache_cache, cache);
+	return 0;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	lock_acquire(&cache->lock);
+
+	struct slab *s = cache->partial;
+	if (!s) {
+		s = _slab_new(cache);
+		if (!s) {
+			lock_release(&cache->lock);
+			return NULL;
+		}
+	}
+
+	void *obj = s->freelist;
+	s->freelist = *(void **)obj;
+	s->inuse++;
+	cache->nr_objs++;
+
+	if (!s->freelist) {
+		_list_del(&cache->partial, s);
+		_list_add(&cache->full, s);
+	}
+
+	lock_release(&cache->lock);
+	return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	struct slab *s = _slab_of(obj);
+	if (s->cache != cache) {
+		printf("kmem_cache_free: %p does not belong to %s\n", obj, cache->name);
+		return;
+	}
+
+	lock_acquire(&cache->lock);
+
+	if (!s->freelist) {
+		_list_del(&cache->full, s);
+		_list_add(&cache->partial, s);
+	}
+
+	*(void **)obj = s->freelist;
+	s->freelist = obj;
+	s->inuse--;
+	cache->nr_objs--;
+
+	/*
+	 * Give an empty slab back to the page allocator, but keep the
+	 * last one to avoid allocating and freeing a page again and again.
+	 */
+	if (s->inuse == 0 && (s->next || s->prev)) {
+		_list_del(&cache->partial, s);
+		page_free(s);
+		cache->nr_slabs--;
+	}
+
+	lock_release(&cache->lock);
+}
+
+/*
+ * DESCRIPTION
+ * 	Allocate size bytes of memory.
+ * 	Requests up to 1024 bytes come from the kmalloc caches, bigger ones
+ * 	are rounded up to whole pages.
+ */
+void *kmalloc(uint32_t size)
+{
+	if (size == 0) {
+		return NULL;
+	}
+
+	if (size > (1 << KMALLOC_MAX_ORDER)) {
+		return page_alloc((size + PAGE_SIZE - 1) / PAGE_SIZE);
+	}
+
+	int order = KMALLOC_MIN_ORDER;
+	while ((1 << order) < size) {
+		order++;
+	}
+	return kmem_cache_alloc(_kmalloc_caches[order - KMALLOC_MIN_ORDER]);
+}
+
+void kfree(void *p)
+{
+	if (!p) {
+		return;
+	}
+
+	/*
+	 * objects never start at the beginning of a page, where the slab
+	 * header is, so a page aligned pointer came from page_alloc().
+	 */
+	if (((ptr_t)p & (PAGE_SIZE - 1)) == 0) {
+		page_free(p);
+		return;
+	}
+
+	struct slab *s = _slab_of(p);
+	kmem_cache_free(s->cache, p);
+}
+
+void slab_init()
+{
+	_cache_setup(&_cache_cache, "kmem_cache",
+		     _align(sizeof(struct kmem_cache), SLAB_ALIGN));
+
+	for (int i = KMALLOC_MIN_ORDER; i <= KMALLOC_MAX_ORDER; i++) {
+		_kmalloc_caches[i - KMALLOC_MIN_ORDER] =
+			kmem_cache_create(_kmalloc_names[i - KMALLOC_MIN_ORDER], 1 << i);
+	}
+}
+
+void slab_dump()
+{
+	printf("cache            size  objs/slab  slabs  active\n");
+	for (struct kmem_cache *c = _caches; c; c = c->next) {
+		printf("%s\t%d\t%d\t%d\t%d\n",
+		       c->name, c->size, c->num, c->nr_slabs, c->nr_objs);
+	}
+}
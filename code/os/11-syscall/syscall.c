@@ -7,14 +7,40 @@ int sys_gethid(unsigned int *ptr_hid)
 	if (ptr_hid == NULL) {
 		return -1;
 	} else {
-		*ptr_hid = r_mhartid();
-		return 0;
+		/* ptr_hid is a user address, in the address space of the caller */
+		unsigned int hid = r_mhartid();
+		return copyout(SATP_PGTBL(r_satp()), (reg_t)ptr_hid, &hid, sizeof(hid));
 	}
 }
 int sys_sum(int a, int b) {
     // 在核心態下執行加法
     return a + b;
 }
+
+/* defined in sched.c */
+extern void sys_task_exit(int status);
+extern int sys_task_join(int id, reg_t status);
+extern int sys_task_sleep(uint32_t ticks);
+extern int sys_task_sleep_until(uint64_t mtime);
+extern int sys_task_wait_period(void);
+extern int sys_task_stat(int id, reg_t stat);
+
+/* defined in printf.c */
+extern int sys_uart_write(reg_t buf, uint32_t len);
+
+int sys_task_spawn(void (*start_routin)(void *arg), struct task_attr *uattr)
+{
+	struct task_attr attr;
+
+	/* uattr is a user address, in the address space of the caller */
+	if (uattr == NULL) {
+		return task_create(start_routin, NULL);
+	}
+	if (copyin(SATP_PGTBL(r_satp()), &attr, (reg_t)uattr, sizeof(attr)) < 0) {
+		return -1;
+	}
+	return task_create(start_routin, &attr);
+}
 void do_syscall(struct context *cxt)
 {
 	uint32_t syscall_num = cxt->a7;
@@ -32,6 +58,36 @@ void do_syscall(struct context *cxt)
             //[cite_start]// 將返回值寫回 context 的 a0 欄位 [cite: 1142]
             cxt->a0 = result;
             break;
+	case SYS_task_spawn:
+		cxt->a0 = sys_task_spawn((void (*)(void *))cxt->a0, (struct task_attr *)cxt->a1);
+		break;
+	case SYS_task_exit:
+		sys_task_exit(cxt->a0);
+		break;
+	case SYS_task_join:
+		cxt->a0 = sys_task_join(cxt->a0, cxt->a1);
+		break;
+	case SYS_task_sleep:
+		cxt->a0 = sys_task_sleep(cxt->a0);
+		break;
+	case SYS_task_sleep_until:
+		/* a 64-bit argument is passed in a0 (low) and a1 (high) */
+		cxt->a0 = sys_task_sleep_until(((uint64_t)cxt->a1 << 32) | cxt->a0);
+		break;
+	case SYS_task_wait_period:
+		cxt->a0 = sys_task_wait_period();
+		break;
+	case SYS_task_stat:
+		cxt->a0 = sys_task_stat(cxt->a0, cxt->a1);
+		break;
+	case SYS_uart_write:
+		cxt->a0 = sys_uart_write(cxt->a0, cxt->a1);
+		break;
+	case SYS_task_dump:
+		/* the tasks are on the heap, which U-mode can not see */
+		sched_task_dump();
+		break;
+	/* SYS_sched_yield is taken by trap_handler() */
 	default:
 		printf("Unknown syscall no: %d\n", syscall_num);
 		cxt->a0 = -1;
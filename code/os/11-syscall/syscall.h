@@ -1,2 +1,13 @@
 // System call numbers
 #define SYS_gethid	1
+#define SYS_sum		2
+#define SYS_task_spawn	3
+#define SYS_task_exit	4
+#define SYS_task_join	5
+#define SYS_task_sleep	6
+#define SYS_task_sleep_until	7
+#define SYS_task_wait_period	8
+#define SYS_task_stat	9
+#define SYS_sched_yield	10
+#define SYS_task_dump	11
+#define SYS_uart_write	12
@@ -1,14 +1,83 @@
 #include "os.h"
 
 extern void schedule(void);
-
-/* interval ~= 1s */
-#define TIMER_INTERVAL CLINT_TIMEBASE_FREQ
+extern void task_wake_sleepers(uint64_t now);
+extern int sched_idle_percent(void);
+extern uint64_t task_next_wakeup(void);
 
 static uint32_t _tick = 0;
 
+/* timer interrupts taken by each hart */
+static uint32_t _nr_irqs[MAXNUM_CPU];
+
+/*
+ * Interrupt entry latency, mtime from the deadline in mtimecmp till
+ * timer_handler() is entered, summed up over all timer interrupts.
+ * _deadline is the mtimecmp last programmed, an overdue event is
+ * programmed as now rather than as the past deadline, so the latency
+ * is that of the interrupt, not how late the event was.
+ */
+static uint32_t _latency[MAXNUM_CPU];
+static uint64_t _deadline[MAXNUM_CPU];
+
+/* the CPU usage of the tasks is printed every TASK_DUMP_TICKS ticks */
+#define TASK_DUMP_TICKS 10
+static uint32_t _next_dump_tick = TASK_DUMP_TICKS;
+
+#ifdef CONFIG_TICKLESS
+/*
+ * Tickless mode: there is no periodic interrupt. Before it switches to
+ * a task, the scheduler programs the timer of its hart for the earliest
+ * event the hart has to handle, see timer_reprogram(). An idle hart with
+ * no sleeper and no software timer takes no timer interrupt at all.
+ * _tick still counts TIMER_INTERVAL periods for the software timers, it
+ * is brought up to date from mtime whenever it is used.
+ */
+static uint64_t _next_tick_mtime;	/* mtime when _tick is due to advance */
+static struct spinlock _tick_lock;
+
+static void _tick_update(uint64_t now)
+{
+	lock_acquire(&_tick_lock);
+	while (now >= _next_tick_mtime) {
+		_tick++;
+		_next_tick_mtime += TIMER_INTERVAL;
+	}
+	lock_release(&_tick_lock);
+}
+
+/*
+ * Periodic ticks avoided by each hart: a periodic tick would have been
+ * taken at every TIMER_INTERVAL boundary, so when n boundaries have passed
+ * since the last timer interrupt of the hart, this one stands for one of
+ * them and n - 1 were avoided. _irq_next_tick is the next boundary after
+ * the last interrupt, in the same phase as _next_tick_mtime.
+ */
+static uint64_t _irq_next_tick[MAXNUM_CPU];
+static uint32_t _avoided[MAXNUM_CPU];
+
+/* number of tick boundaries passed since the last timer interrupt */
+static uint32_t _ticks_passed(int hart, uint64_t now)
+{
+	uint32_t n = 0;
+
+	while (now >= _irq_next_tick[hart]) {
+		n++;
+		_irq_next_tick[hart] += TIMER_INTERVAL;
+	}
+	return n;
+}
+#endif
+
+/*
+ * timer_list is shared by the tasks, which create and delete timers on
+ * any hart, and timer_check() on hart 0. spin_lock() only keeps the
+ * timer interrupt of the own hart away, _timer_lock keeps the other
+ * harts away.
+ */
 #define MAX_TIMER 10
 static struct timer timer_list[MAX_TIMER];
+static struct spinlock _timer_lock;
 
 /* load timer interval(in ticks) for next timer interrupt.*/
 void timer_load(int interval)
@@ -16,28 +85,119 @@ void timer_load(int interval)
 	/* each CPU has a separate source of timer interrupts. */
 	int id = r_mhartid();
 	
-	*(uint64_t*)CLINT_MTIMECMP(id) = *(uint64_t*)CLINT_MTIME + interval;
+	_deadline[id] = *(uint64_t*)CLINT_MTIME + interval;
+	*(uint64_t*)CLINT_MTIMECMP(id) = _deadline[id];
 }
 
-void timer_init()
+#ifdef CONFIG_TICKLESS
+/*
+ * Write the 64-bit mtimecmp with 32-bit stores, without passing through
+ * a value which is smaller than both the old and the new one.
+ */
+static void _set_mtimecmp(int hart, uint64_t t)
 {
-	struct timer *t = &(timer_list[0]);
+	volatile uint32_t *p = (volatile uint32_t *)CLINT_MTIMECMP(hart);
+
+	p[0] = 0xffffffff;
+	p[1] = t >> 32;
+	p[0] = (uint32_t)t;
+}
+
+/* mtime of the first software timer to expire, or ~0 if none */
+static uint64_t _timer_next_expiry()
+{
+	uint64_t next = ~(uint64_t)0;
+
 	for (int i = 0; i < MAX_TIMER; i++) {
-		t->func = NULL; /* use .func to flag if the item is used */
-		t->arg = NULL;
-		t++;
+		struct timer *t = &timer_list[i];
+		if (NULL == t->func) {
+			continue;
+		}
+
+		uint64_t at;
+		if (t->timeout_tick <= _tick) {
+			at = 0;
+		} else {
+			at = _next_tick_mtime +
+			     (uint64_t)(t->timeout_tick - _tick - 1) * TIMER_INTERVAL;
+		}
+		if (at < next) {
+			next = at;
+		}
 	}
+	return next;
+}
+
+/*
+ * DESCRIPTION
+ * 	Program the timer of the calling hart for the earliest of:
+ * 	- the end of the time slice, unless slice is TIMER_NO_SLICE, i.e. a
+ * 	  task other than the idle task is about to run. A slice of 0, a
+ * 	  SCHED_EDF task with no budget left, fires right away.
+ * 	- the wakeup of the first sleeper
+ * 	- the expiry of the first software timer, on hart 0 which runs them
+ * 	Called by the scheduler right before it switches to the next task.
+ */
+void timer_reprogram(uint32_t slice)
+{
+	int hart = r_tp();
+	uint64_t now = get_mtime();
+	uint64_t next = task_next_wakeup();
 
+	if (slice != TIMER_NO_SLICE && now + slice < next) {
+		next = now + slice;
+	}
+	if (hart == 0) {
+		_tick_update(now);
+		lock_acquire(&_timer_lock);
+		uint64_t t = _timer_next_expiry();
+		lock_release(&_timer_lock);
+		if (t < next) {
+			next = t;
+		}
+	}
+	if (next < now) {
+		next = now;
+	}
+	_deadline[hart] = next;
+	_set_mtimecmp(hart, next);
+}
+#endif
+
+/* start the timer interrupts of the calling hart */
+void timer_init_hart()
+{
 	/*
 	 * On reset, mtime is cleared to zero, but the mtimecmp registers 
 	 * are not reset. So we have to init the mtimecmp manually.
 	 */
 	timer_load(TIMER_INTERVAL);
 
+#ifdef CONFIG_TICKLESS
+	lock_acquire(&_tick_lock);
+	_irq_next_tick[r_tp()] = _next_tick_mtime;
+	lock_release(&_tick_lock);
+#endif
+
 	/* enable machine-mode timer interrupts. */
 	w_mie(r_mie() | MIE_MTIE);
 }
 
+void timer_init()
+{
+	struct timer *t = &(timer_list[0]);
+	for (int i = 0; i < MAX_TIMER; i++) {
+		t->func = NULL; /* use .func to flag if the item is used */
+		t->arg = NULL;
+		t++;
+	}
+
+#ifdef CONFIG_TICKLESS
+	_next_tick_mtime = get_mtime() + TIMER_INTERVAL;
+#endif
+	timer_init_hart();
+}
+
 struct timer *timer_create(void (*handler)(void *arg), void *arg, uint32_t timeout)
 {
 	/* TBD: params should be checked more, but now we just simplify this */
@@ -47,6 +207,11 @@ struct timer *timer_create(void (*handler)(void *arg), void *arg, uint32_t timeo
 
 	/* use lock to protect the shared timer_list between multiple tasks */
 	spin_lock();
+	lock_acquire(&_timer_lock);
+
+#ifdef CONFIG_TICKLESS
+	_tick_update(get_mtime());
+#endif
 
 	struct timer *t = &(timer_list[0]);
 	for (int i = 0; i < MAX_TIMER; i++) {
@@ -56,6 +221,7 @@ struct timer *timer_create(void (*handler)(void *arg), void *arg, uint32_t timeo
 		t++;
 	}
 	if (NULL != t->func) {
+		lock_release(&_timer_lock);
 		spin_unlock();
 		return NULL;
 	}
@@ -64,14 +230,21 @@ struct timer *timer_create(void (*handler)(void *arg), void *arg, uint32_t timeo
 	t->arg = arg;
 	t->timeout_tick = _tick + timeout;
 
+	lock_release(&_timer_lock);
 	spin_unlock();
 
+#ifdef CONFIG_TICKLESS
+	/* let hart 0 program its timer for it */
+	*(uint32_t*)CLINT_MSIP(0) = 1;
+#endif
+
 	return t;
 }
 
 void timer_delete(struct timer *timer)
 {
 	spin_lock();
+	lock_acquire(&_timer_lock);
 
 	struct timer *t = &(timer_list[0]);
 	for (int i = 0; i < MAX_TIMER; i++) {
@@ -83,17 +256,26 @@ void timer_delete(struct timer *timer)
 		t++;
 	}
 
+	lock_release(&_timer_lock);
 	spin_unlock();
 }
 
-/* this routine should be called in interrupt context (interrupt is disabled) */
+/*
+ * this routine should be called in interrupt context (interrupt is disabled)
+ * The handler runs without _timer_lock, it may create another timer.
+ */
 static inline void timer_check()
 {
+	void (*func)(void *arg) = NULL;
+	void *arg = NULL;
+
+	lock_acquire(&_timer_lock);
 	struct timer *t = &(timer_list[0]);
 	for (int i = 0; i < MAX_TIMER; i++) {
 		if (NULL != t->func) {
 			if (_tick >= t->timeout_tick) {
-				t->func(t->arg);
+				func = t->func;
+				arg = t->arg;
 
 				/* once time, just delete it after timeout */
 				t->func = NULL;
@@ -104,16 +286,70 @@ static inline void timer_check()
 		}
 		t++;
 	}
+	lock_release(&_timer_lock);
+
+	if (func) {
+		func(arg);
+	}
 }
 
+/*
+ * Each hart takes its own timer interrupts. Hart 0 keeps the tick count
+ * and runs the software timers, every hart wakes up the sleepers which
+ * are due and reschedules.
+ * With CONFIG_TICKLESS, a hart may take many interrupts within a tick,
+ * for sleepers and the ends of short slices, so it only reports when a
+ * tick boundary has passed since its last interrupt, and the periodic
+ * ticks it has avoided are reported too.
+ */
 void timer_handler() 
 {
-	_tick++;
-	printf("tick: %d\n", _tick);
+	int hart = r_tp();
+	uint64_t now = get_mtime();
+	int report = 1;
+
+	_latency[hart] += (uint32_t)(now - _deadline[hart]);
+	_nr_irqs[hart]++;
+
+#ifdef CONFIG_TICKLESS
+	uint32_t passed = _ticks_passed(hart, now);
+	if (passed > 1) {
+		_avoided[hart] += passed - 1;
+	}
+	report = passed > 0;
+#endif
+
+	if (hart == 0) {
+#ifdef CONFIG_TICKLESS
+		_tick_update(now);
+#else
+		_tick++;
+#endif
+		if (report) {
+			printf("tick: %d, idle: %d percent\n", _tick, sched_idle_percent());
+		}
+		timer_check();
+		if (_tick >= _next_dump_tick) {
+			sched_task_dump();
+			_next_dump_tick = _tick + TASK_DUMP_TICKS;
+		}
+	} else if (report) {
+		printf("hart %d idle: %d percent\n", hart, sched_idle_percent());
+	}
+	if (report) {
+#ifdef CONFIG_TICKLESS
+		printf("hart %d timer irqs: %d, avoided: %d\n",
+		       hart, _nr_irqs[hart], _avoided[hart]);
+#endif
+		printf("hart %d timer irq latency: %d ns\n", hart,
+		       _latency[hart] * (1000 / US_TO_MTIME(1)) / _nr_irqs[hart]);
+	}
 
-	timer_check();
+	task_wake_sleepers(now);
 
+#ifndef CONFIG_TICKLESS
 	timer_load(TIMER_INTERVAL);
+#endif
 
 	schedule();
 }
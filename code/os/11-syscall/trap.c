@@ -1,17 +1,33 @@
 #include "os.h"
+#include "syscall.h"
 
 extern void trap_vector(void);
+#ifdef CONFIG_TRAP_VECTORED
+extern void trap_vectors(void);
+#endif
 extern void uart_isr(void);
 extern void timer_handler(void);
 extern void schedule(void);
 extern void do_syscall(struct context *cxt);
+extern void task_account_trap(struct context *cxt);
+extern void task_account_return(void);
+extern int task_fp_trap(struct context *cxt);
+extern void sys_sched_yield(void);
+#ifdef CONFIG_SYSCALL
+extern int task_stack_grow(struct context *cxt, reg_t addr);
+#endif
 
 void trap_init()
 {
 	/*
 	 * set the trap-vector base-address for machine-mode
 	 */
+#ifdef CONFIG_TRAP_VECTORED
+	/* MODE 1, vectored, the table is 4-byte aligned */
+	w_mtvec((reg_t)trap_vectors | 1);
+#else
 	w_mtvec((reg_t)trap_vector);
+#endif
 }
 
 void external_interrupt_handler()
@@ -33,18 +49,18 @@ reg_t trap_handler(reg_t epc, reg_t cause, struct context *cxt)
 {
 	reg_t return_pc = epc;
 	reg_t cause_code = cause & MCAUSE_MASK_ECODE;
+
+	task_account_trap(cxt);
 	
 	if (cause & MCAUSE_MASK_INTERRUPT) {
 		/* Asynchronous trap - interrupt */
 		switch (cause_code) {
 		case 3:
-			uart_puts("software interruption!\n");
 			/*
 			 * acknowledge the software interrupt by clearing
     			 * the MSIP bit in mip.
 			 */
-			int id = r_mhartid();
-    			*(uint32_t*)CLINT_MSIP(id) = 0;
+    			*(uint32_t*)CLINT_MSIP(r_mhartid()) = 0;
 
 			schedule();
 
@@ -61,24 +77,103 @@ reg_t trap_handler(reg_t epc, reg_t cause, struct context *cxt)
 			printf("Unknown async exception! Code = %ld\n", cause_code);
 			break;
 		}
+	} else if (cause_code == 8 && cxt->a7 == SYS_sched_yield) {
+		/*
+		 * voluntary yield, switch to the next task without a word,
+		 * unless trap_vector has taken it already, see yield_handler()
+		 */
+		cxt->pc = return_pc + 4;
+		sys_sched_yield();
+	} else if (cause_code == 8 && cxt->a7 == SYS_uart_write) {
+		/*
+		 * printf() of a task, not announced, or each line it prints
+		 * would come with two more
+		 */
+		cxt->pc = return_pc + 4;
+		do_syscall(cxt);
+		return_pc = cxt->pc;
+	} else if (cause_code == 2 && task_fp_trap(cxt) == 0) {
+		/*
+		 * first FP instruction of a task since it was switched in,
+		 * its registers are loaded now, it happens all the time
+		 */
+#ifdef CONFIG_SYSCALL
+	} else if ((cause_code == 13 || cause_code == 15) &&
+		   task_stack_grow(cxt, r_mtval()) == 0) {
+		/* load/store page fault below the stack, which has grown */
+#endif
 	} else {
 		/* Synchronous trap - exception */
 		printf("Sync exceptions! Code = %ld\n", cause_code);
 		switch (cause_code) {
 		case 8:
 			uart_puts("System call from U-mode!\n");
+			/*
+			 * Return to the instruction after ecall. Set it in the
+			 * context too, a syscall which blocks switches to
+			 * another task and resumes from the context later.
+			 */
+			cxt->pc = return_pc + 4;
 			do_syscall(cxt);
-			return_pc += 4;
+			return_pc = cxt->pc;
+			break;
+#ifdef CONFIG_SYSCALL
+		case 13:
+		case 15:
+			printf("page fault at %p, pc = %p\n", r_mtval(), epc);
+			panic("OOPS! What can I do!");
 			break;
+#endif
 		default:
 			panic("OOPS! What can I do!");
 			//return_pc += 4;
 		}
 	}
 
+	task_account_return();
 	return return_pc;
 }
 
+#ifdef CONFIG_TRAP_VECTORED
+/*
+ * Entries of the interrupts with their own vectors, see trap_vectors in
+ * entry.S. The cause is known, and nothing is printed.
+ * The software and timer interrupts end in schedule() and do not return.
+ */
+void msoft_entry(struct context *cxt)
+{
+	task_account_trap(cxt);
+	*(uint32_t *)CLINT_MSIP(r_tp()) = 0;
+	schedule();
+}
+
+void mtimer_entry(struct context *cxt)
+{
+	task_account_trap(cxt);
+	timer_handler();
+}
+
+/* only the caller-saved registers are in cxt, it returns to the task */
+void mext_entry(struct context *cxt)
+{
+	task_account_trap(cxt);
+	external_interrupt_handler();
+	task_account_return();
+}
+#endif
+
+#ifdef CONFIG_YIELD_CALLEE_SAVED
+/*
+ * sched_yield syscall, trap_vector has saved the callee-saved registers
+ * and the pc after ecall only. It does not return.
+ */
+void yield_handler(struct context *cxt)
+{
+	task_account_trap(cxt);
+	sys_sched_yield();
+}
+#endif
+
 void trap_test()
 {
 	/*
@@ -6,6 +6,9 @@ typedef unsigned short uint16_t;
 typedef unsigned int  uint32_t;
 typedef unsigned long long uint64_t;
 
+typedef signed char int8_t;
+typedef long long int64_t;
+
 /*
  * Register Width
  */
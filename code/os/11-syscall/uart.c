@@ -135,7 +135,14 @@ int uart_getc(void)
  */
 void uart_isr(void)
 {
-	uart_putc((char)uart_getc());
+	char ch = (char)uart_getc();
+
+	uart_putc(ch);
 	/* add a new line just to look better */
 	uart_putc('\n');
+
+	/* console commands */
+	if (ch == 's') {
+		sched_stack_dump();
+	}
 }
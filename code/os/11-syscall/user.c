@@ -4,9 +4,28 @@
 
 #define DELAY 4000
 
-void user_task0(void)
+#ifdef CONFIG_BENCH
+extern int bench_main(void);
+#endif
+
+#ifdef CONFIG_SYSCALL
+/* a short-lived worker spawned by task 0 */
+void user_worker(void *arg)
+{
+	int n = (int)arg;
+	printf("Worker: sum of 1..%d\n", n);
+
+	int s = 0;
+	for (int i = 1; i <= n; i++) {
+		s += i;
+	}
+	task_exit(s);
+}
+#endif
+
+void user_task0(void *arg)
 {
-	uart_puts("Task 0: Created!\n");
+	printf("Task 0: Created!\n");
 
 	unsigned int hid = -1;
 
@@ -29,19 +48,28 @@ void user_task0(void)
 
 	int result = sum(10, 20);
 	printf("10 + 20 = %d\n", result);
+
+	struct task_attr attr = { .arg = (void *)100, .stack_size = PAGE_SIZE };
+	int status = -1;
+	int id = task_spawn(user_worker, &attr);
+	if (id > 0 && task_join(id, &status) == id) {
+		printf("worker %d exited with %d\n", id, status);
+	} else {
+		printf("task_spawn()/task_join() failed\n");
+	}
 #endif
 
 	while (1){
-		uart_puts("Task 0: Running... \n");
+		printf("Task 0: Running... \n");
 		task_delay(DELAY);
 	}
 }
 
-void user_task1(void)
+void user_task1(void *arg)
 {
-	uart_puts("Task 1: Created!\n");
+	printf("Task 1: Created!\n");
 	while (1) {
-		uart_puts("Task 1: Running... \n");
+		printf("Task 1: Running... \n");
 		task_delay(DELAY);
 	}
 }
@@ -49,7 +77,15 @@ void user_task1(void)
 /* NOTICE: DON'T LOOP INFINITELY IN main() */
 void os_main(void)
 {
-	task_create(user_task0);
-	task_create(user_task1);
+#ifdef CONFIG_BENCH
+	if (bench_main()) {
+		return;
+	}
+#endif
+
+	struct task_attr attr = { .priority = 1 };
+
+	task_create(user_task0, &attr);
+	task_create(user_task1, &attr);
 }
 
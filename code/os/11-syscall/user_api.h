@@ -5,4 +5,18 @@
 extern int gethid(unsigned int *hid);
 extern int sum(int a, int b);
 
+struct task_attr;
+extern int task_spawn(void (*func)(void *arg), const struct task_attr *attr);
+extern void task_exit(int status);
+extern int task_join(int id, int *status);
+extern int task_sleep(uint32_t ticks);
+extern int task_sleep_until(uint64_t mtime);
+extern int task_wait_period(void);
+extern void sched_yield(void);
+
+struct task_stat;
+extern int task_stat(int id, struct task_stat *stat);
+extern void task_dump(void);
+extern int uart_write(const char *buf, uint32_t len);
+
 #endif /* __USER_API_H__ */
@@ -0,0 +1,345 @@
+#include "os.h"
+
+/*
+ * Following global vars are defined in mem.S
+ */
+extern ptr_t TEXT_START;
+extern ptr_t DATA_START;
+extern ptr_t BSS_END;
+
+/*
+ * Sv32 virtual memory for the user tasks.
+ *
+ * The kernel runs in M-mode, where no address translation is done, so it
+ * needs no page table of its own and always sees physical addresses.
+ * Each task has its own address space, a two-level Sv32 page table which
+ * takes effect when switch_to() writes satp and returns to U-mode.
+ *
+ * Every address space starts with the root entries of _kernel_pgtbl, the
+ * part of the kernel U-mode still uses: the tasks call kernel code such as
+ * printf() and task_delay() directly, and those touch kernel globals. So
+ * the kernel image is identity mapped with 4K pages, text and rodata
+ * U|R|X, data and bss U|R|W, and the page of mtime U|R for get_mtime().
+ * The rest of CLINT is left out, or a task could write the mtimecmp and
+ * msip of any hart, task_yield() takes the sched_yield syscall instead.
+ * The UART is left out too, tasks print through the uart_write syscall.
+ * The heap, where the page tables, task structures and user pages live, is
+ * not mapped at all. The level-0 tables of the kernel map are shared by
+ * all address spaces, their root entries are marked PTE_G and are never
+ * changed or freed through an address space.
+ *
+ * This keeps a task off the pages of other tasks, but not off the kernel
+ * globals, it is no isolation yet. That takes the kernel code to run in a
+ * mode of its own.
+ *
+ * Private 4K mappings of a task are added in the address range which is
+ * not used by the kernel map, with vm_map() or vm_alloc(). The level-0
+ * page tables are allocated on demand and freed by vm_destroy().
+ */
+
+static pte_t *_kernel_pgtbl = NULL;
+
+#define PTE_KERNEL_TEXT (PTE_R | PTE_X | PTE_U | PTE_G)
+#define PTE_KERNEL_DATA (PTE_R | PTE_W | PTE_U | PTE_G)
+#define PTE_KERNEL_MTIME (PTE_R | PTE_U | PTE_G)
+
+static inline reg_t _page_round_down(reg_t a)
+{
+	return a & ~(PAGE_SIZE - 1);
+}
+
+static inline reg_t _page_round_up(reg_t a)
+{
+	return (a + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+/* a root entry of the kernel map, shared by all address spaces */
+static inline int _kernel_pte(pte_t pte)
+{
+	return (pte & (PTE_V | PTE_G)) == (PTE_V | PTE_G);
+}
+
+/* identity map [pa, pa + size) with 4K pages into the kernel map */
+static void _kmap(reg_t pa, uint32_t size, int perm)
+{
+	reg_t end = pa + size;
+
+	for (pa = _page_round_down(pa); pa < end; pa += PAGE_SIZE) {
+		pte_t *root = &_kernel_pgtbl[PX(1, pa)];
+		if (!(*root & PTE_V)) {
+			pte_t *l0 = (pte_t *)page_alloc_zeroed(1);
+			if (!l0) {
+				panic("vm_init: out of memory");
+			}
+			*root = PA2PTE(l0) | PTE_V | PTE_G;
+		}
+		((pte_t *)PTE2PA(*root))[PX(0, pa)] =
+			PA2PTE(pa) | perm | PTE_V | PTE_A | PTE_D;
+	}
+}
+
+void vm_init()
+{
+	_kernel_pgtbl = (pte_t *)page_alloc_zeroed(1);
+	if (!_kernel_pgtbl) {
+		panic("vm_init: out of memory");
+	}
+
+	/* .rodata follows .text on the same page, only .data is page aligned */
+	_kmap(TEXT_START, DATA_START - TEXT_START, PTE_KERNEL_TEXT);
+	_kmap(DATA_START, _page_round_up(BSS_END) - DATA_START, PTE_KERNEL_DATA);
+	_kmap(CLINT_MTIME, sizeof(uint64_t), PTE_KERNEL_MTIME);
+}
+
+/*
+ * Return the address of the level-0 PTE for va. If alloc is set, the
+ * level-0 page table is created if it does not exist yet.
+ * Return NULL if there is no such table, or va is covered by the kernel
+ * map.
+ */
+static pte_t *_walk(pte_t *pgtbl, reg_t va, int alloc)
+{
+	pte_t *pte = &pgtbl[PX(1, va)];
+
+	if (*pte & PTE_V) {
+		if (_kernel_pte(*pte)) {
+			return NULL;
+		}
+		pgtbl = (pte_t *)PTE2PA(*pte);
+	} else {
+		if (!alloc) {
+			return NULL;
+		}
+		pgtbl = (pte_t *)page_alloc_zeroed(1);
+		if (!pgtbl) {
+			return NULL;
+		}
+		*pte = PA2PTE(pgtbl) | PTE_V;
+	}
+
+	return &pgtbl[PX(0, va)];
+}
+
+/*
+ * Return the leaf PTE which maps va and the physical address of va in
+ * *pa. Return 0 if va is not mapped. All mappings are 4K pages.
+ */
+static pte_t _lookup(pte_t *pgtbl, reg_t va, reg_t *pa)
+{
+	pte_t pte = pgtbl[PX(1, va)];
+
+	if (!(pte & PTE_V)) {
+		return 0;
+	}
+	pte = ((pte_t *)PTE2PA(pte))[PX(0, va)];
+	if (!(pte & PTE_V)) {
+		return 0;
+	}
+	*pa = PTE2PA(pte) + (va & (PAGE_SIZE - 1));
+	return pte;
+}
+
+/*
+ * DESCRIPTION
+ * 	Create an address space, with the kernel map only.
+ * RETURN VALUE
+ * 	the root page table, or NULL if out of memory.
+ */
+pte_t *vm_create()
+{
+	pte_t *pgtbl = (pte_t *)page_alloc(1);
+	if (!pgtbl) {
+		return NULL;
+	}
+
+	for (int i = 0; i < PAGE_SIZE / sizeof(pte_t); i++) {
+		pgtbl[i] = _kernel_pgtbl[i];
+	}
+	return pgtbl;
+}
+
+/*
+ * DESCRIPTION
+ * 	Map [va, va + size) to the physical pages starting at pa.
+ * 	- va, pa: page aligned
+ * 	- perm: PTE_R/PTE_W/PTE_X/PTE_U, plus PTE_OWNED to free the pages
+ * 	  with page_free() when they are unmapped.
+ * RETURN VALUE
+ * 	0: success
+ * 	-1: if va is mapped already or out of memory, pages mapped before the
+ * 	    failure stay mapped.
+ */
+int vm_map(pte_t *pgtbl, reg_t va, reg_t pa, uint32_t size, int perm)
+{
+	for (reg_t a = va; a < va + size; a += PAGE_SIZE, pa += PAGE_SIZE) {
+		pte_t *pte = _walk(pgtbl, a, 1);
+		if (!pte || (*pte & PTE_V)) {
+			return -1;
+		}
+		*pte = PA2PTE(pa) | perm | PTE_V | PTE_A | PTE_D;
+	}
+	return 0;
+}
+
+/*
+ * DESCRIPTION
+ * 	Allocate zeroed pages and map them at [va, va + size), the pages are
+ * 	freed when they are unmapped.
+ * RETURN VALUE
+ * 	0: success
+ * 	-1: if va is mapped already or out of memory, nothing is mapped then.
+ */
+int vm_alloc(pte_t *pgtbl, reg_t va, uint32_t size, int perm)
+{
+	for (reg_t a = va; a < va + size; a += PAGE_SIZE) {
+		void *p = page_alloc_zeroed(1);
+		if (!p) {
+			vm_unmap(pgtbl, va, a - va);
+			return -1;
+		}
+		if (vm_map(pgtbl, a, (reg_t)p, PAGE_SIZE, perm | PTE_OWNED) < 0) {
+			page_free(p);
+			vm_unmap(pgtbl, va, a - va);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * DESCRIPTION
+ * 	Unmap the 4K pages in [va, va + size), va must be page aligned.
+ * 	Pages of the kernel map are never unmapped.
+ * RETURN VALUE
+ * 	number of pages unmapped.
+ */
+int vm_unmap(pte_t *pgtbl, reg_t va, uint32_t size)
+{
+	int n = 0;
+
+	for (reg_t a = va; a < va + size; a += PAGE_SIZE) {
+		pte_t *pte = _walk(pgtbl, a, 0);
+		if (!pte || !(*pte & PTE_V)) {
+			continue;
+		}
+		if (*pte & PTE_OWNED) {
+			page_free((void *)PTE2PA(*pte));
+		}
+		*pte = 0;
+		n++;
+	}
+
+	/* the address space may be the one in satp */
+	if (n) {
+		sfence_vma();
+	}
+	return n;
+}
+
+/*
+ * DESCRIPTION
+ * 	Free an address space with all its page tables and owned pages.
+ * 	It must not be the one in satp of a running task.
+ */
+void vm_destroy(pte_t *pgtbl)
+{
+	for (int i = 0; i < PAGE_SIZE / sizeof(pte_t); i++) {
+		pte_t pte = pgtbl[i];
+		if (!(pte & PTE_V) || _kernel_pte(pte)) {
+			continue;
+		}
+
+		pte_t *l0 = (pte_t *)PTE2PA(pte);
+		for (int j = 0; j < PAGE_SIZE / sizeof(pte_t); j++) {
+			if ((l0[j] & PTE_V) && (l0[j] & PTE_OWNED)) {
+				page_free((void *)PTE2PA(l0[j]));
+			}
+		}
+		page_free(l0);
+	}
+	page_free(pgtbl);
+}
+
+/*
+ * DESCRIPTION
+ * 	Translate a user virtual address.
+ * RETURN VALUE
+ * 	the physical address, or 0 if va is not mapped.
+ */
+reg_t vm_translate(pte_t *pgtbl, reg_t va)
+{
+	reg_t pa;
+
+	if (!_lookup(pgtbl, va, &pa)) {
+		return 0;
+	}
+	return pa;
+}
+
+/*
+ * DESCRIPTION
+ * 	Copy len bytes from the kernel to dstva of the address space, as the
+ * 	user would do: each page must be user writable.
+ * RETURN VALUE
+ * 	0: success
+ * 	-1: if a page is not mapped or not writable by the user
+ */
+int copyout(pte_t *pgtbl, reg_t dstva, const void *src, uint32_t len)
+{
+	const uint8_t *s = (const uint8_t *)src;
+
+	while (len > 0) {
+		reg_t pa;
+		pte_t pte = _lookup(pgtbl, dstva, &pa);
+		if ((pte & (PTE_U | PTE_W)) != (PTE_U | PTE_W)) {
+			return -1;
+		}
+
+		uint32_t n = _page_round_down(dstva) + PAGE_SIZE - dstva;
+		if (n > len) {
+			n = len;
+		}
+		for (uint32_t i = 0; i < n; i++) {
+			((uint8_t *)pa)[i] = s[i];
+		}
+
+		len -= n;
+		s += n;
+		dstva += n;
+	}
+	return 0;
+}
+
+/*
+ * DESCRIPTION
+ * 	Copy len bytes from srcva of the address space to the kernel, each
+ * 	page must be user readable.
+ * RETURN VALUE
+ * 	0: success
+ * 	-1: if a page is not mapped or not readable by the user
+ */
+int copyin(pte_t *pgtbl, void *dst, reg_t srcva, uint32_t len)
+{
+	uint8_t *d = (uint8_t *)dst;
+
+	while (len > 0) {
+		reg_t pa;
+		pte_t pte = _lookup(pgtbl, srcva, &pa);
+		if ((pte & (PTE_U | PTE_R)) != (PTE_U | PTE_R)) {
+			return -1;
+		}
+
+		uint32_t n = _page_round_down(srcva) + PAGE_SIZE - srcva;
+		if (n > len) {
+			n = len;
+		}
+		for (uint32_t i = 0; i < n; i++) {
+			d[i] = ((uint8_t *)pa)[i];
+		}
+
+		len -= n;
+		d += n;
+		srcva += n;
+	}
+	return 0;
+}
@@ -6,3 +6,46 @@ ifeq (${SYSCALL}, y)
 DEFS += -DCONFIG_SYSCALL
 endif
 
+ifeq (${PAGE_ALLOCATOR}, buddy)
+DEFS += -DCONFIG_PAGE_BUDDY
+endif
+
+ifeq (${DEFERRED_PAGE_INIT}, y)
+DEFS += -DCONFIG_DEFERRED_PAGE_INIT
+endif
+
+ifeq (${PARALLEL_BSS}, y)
+DEFS += -DCONFIG_PARALLEL_BSS
+endif
+
+ifeq (${SCHED_STEAL}, y)
+DEFS += -DCONFIG_SCHED_STEAL
+endif
+
+ifeq (${TICKLESS}, y)
+DEFS += -DCONFIG_TICKLESS
+endif
+
+ifeq (${TRAP_VECTORED}, y)
+DEFS += -DCONFIG_TRAP_VECTORED
+endif
+
+ifeq (${STACK_GUARD}, y)
+DEFS += -DCONFIG_STACK_GUARD
+endif
+
+ifeq (${YIELD_CALLEE_SAVED}, y)
+DEFS += -DCONFIG_YIELD_CALLEE_SAVED
+endif
+
+# Number of harts, given to QEMU with -smp and to the kernel as NCPU,
+# e.g. "make run NCPU=4".
+NCPU ?= 1
+DEFS += -DNCPU=${NCPU}
+
+# Select a benchmark to build in, e.g. "make run BENCH=PAGE".
+# Remember to "make clean" first when switching, objects are not rebuilt
+# automatically when DEFS changes.
+ifneq (${BENCH},)
+DEFS += -DCONFIG_BENCH -DCONFIG_BENCH_${BENCH}
+endif